@@ -4,18 +4,43 @@
 /* see <Http://Www.Gnu.Org/Licenses/Gpl.Html> */
 /* Modified to run on Ubuntu 8.04LTS by RJR */
 
+#define _GNU_SOURCE
+
 #include <sys/types.h>
 #include <sys/select.h>
-#include <sys/sysinfo.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <scsi/sg.h>
 #include <fcntl.h>
+#include <spawn.h>
+#include <dirent.h>
 #include <termios.h>
 #include <time.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <math.h>
 #include <signal.h>
+#include <errno.h>
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <syslog.h>
 
 #ifdef __FreeBSD__
 #include <fcntl.h>
@@ -27,19 +52,22 @@
 #endif
 
 #include "version.h"
+#include "lcdshm.h"
 
 /* The LCD device */     
 #define LCDDEVICE "/dev/ttyS0"
 #define LINELEN 16
 #define BAUDRATE B9600
 
-/* The ETHERNET devices */
-#define ETH0 "/usr/local/sbin/ipaddr enp0s8"
-#define ETH1 "/usr/local/sbin/ipaddr enp0s9"
+/* The ETHERNET devices shown on the LAN address page, -i overrides */
+static const char *lanif[2] = {"enp0s8", "enp0s9"};
 
 #define CELSIUS    0
 #define FAHRENHEIT 1
 int tempunit = CELSIUS;
+static int diskMaxAge;
+static int extMaxAge;
+static int prefetchBudget;
 
 /* 24 hour time */
 /* #define TIMEFORMAT "%H:%M" */
@@ -48,7 +76,7 @@ int tempunit = CELSIUS;
 
 /* this requires a kernel >= 2.6 with sysfs */
 /* lmsensors must be installed, see http://secure.netroedge.com/~lm78/ */
-/* and smartcntrl for disk temperatures */
+/* disk temperatures come from the drivetemp driver or SMART via SG_IO */
 
 
 /* we use the lm86 to read the temperature information from */
@@ -64,6 +92,7 @@ int tempunit = CELSIUS;
 static const char _SYSTEMPINP[] = "temp1_input";
 static const char _SYSTEMPMAX[] = "temp1_max";
 #define SYSTEMPHYST 8 /* hysteresis */
+#define SYSTEMPDEFAULT 45 /* fan on if the chip has no temp1_max */
 
 /* External CPU temperature */
 static const char _CPUTEMPINP[] = "temp2_input";	/* current temp */
@@ -73,6 +102,7 @@ static const char _CPUTEMPMAX[] = "temp2_max";		/* max temp -> fan on */
 //static const char _SBRTEMPMAX[] = "temp3_max";		/* max temp -> fan on */
 
 #define CPUTEMPHYST 8 /* hysteresis */
+#define CPUTEMPDEFAULT 60 /* fan on if the chip has no temp2_max */
 
 /* we use the via686a to find the fan revolutions */
 
@@ -84,12 +114,39 @@ static const char _SYSBASENAME_VIA[] = "/sys/devices/platform/via686a.24576/";
 static const char _SYSFANINP[] =  "fan2_input";
 static const char _CPUFANINP[] =  "fan1_input";
 
+/* the paths above are only the fallback, at startup lcd looks for */
+/* a known chip or for channel labels below this directory */
+#define HWMONCLASS "/sys/class/hwmon"
+static const char *hwmonClass = HWMONCLASS;	/* the backend may move it */
+
 
 #define DEB 0			/* if 1, writes info to stderr */
 #define TEST 0			/* if 1, disables shutdown code */
 #define HMS_PRIVATE 1		/* if 1, enable private stuff for me */
 
 #define POWERDOWNWAIT 25 	/* about this many seconds a powerdown takes */ 
+#define FANINTERVAL 10		/* seconds between two thermal checks */
+#define REDISCOVER 10		/* seconds between two searches for lost sensors */
+#define PWMMAX 255		/* full speed on a pwm channel */
+#define PIKP 8			/* duty per degree above the set point */
+#define PIKI 0.1		/* duty per degree and second */
+#define PWMSTEP 8		/* smaller duty changes are not written ... */
+#define PWMGAP 30		/* ... nor any more often than this many seconds ... */
+#define PWMJUMP 64		/* ... unless the change is at least this big */
+#define MAXCURVE 8		/* points of a fan curve */
+#define DOUBLEPRESS 3000	/* ms to press the second button for power off */
+#define DISKMAXAGE 300		/* seconds a disk temperature is kept, -a overrides */
+#define MAXDISKWORKERS 4	/* disks queried at the same time */
+#define PREFETCHBUDGET 60	/* background page prefetches per hour, -p overrides */
+#define EXTADDRAGE 3600		/* seconds the external address is kept while the default route stays */
+#define EXTRETRY 10		/* seconds to the first retry of a failed lookup, doubled each time */
+#define EXTRETRYMAX 1800	/* longest wait between two failed lookups */
+#define HTTPTIMEOUT 10		/* seconds an endpoint has to answer */
+#define RESOLVEAGE 3600		/* seconds a resolved endpoint address is kept */
+#define JOBTIMEOUT 60		/* seconds a firewall or WLAN command may run */
+#define JOBKILLWAIT 5		/* seconds from SIGTERM to SIGKILL after that */
+#define HISTORYFILE "/var/tmp/lcd.history"  /* sensor history, -t overrides */
+#define METRICSINTERVAL 15	/* seconds between two metrics files, -M overrides */
 
 #if TEST
 #define DARKUNTIL 24
@@ -108,8 +165,10 @@ static const char _CPUFANINP[] =  "fan1_input";
 /* definitions for sensor handling */
 
 typedef struct {
-    const char *base;
+    const char *base;	/* fallback if discovery finds nothing */
     const char *name;
+    int fd;		/* kept open between samples, -1 if not open */
+    char path[128];	/* found by discoverSensors() */
 } Sensors;
 
 typedef enum {
@@ -119,15 +178,33 @@ typedef enum {
     SYSTEMPMAX,
     SYSFANINP,
     CPUFANINP,
+    CPUFANPWM,
+    SYSFANPWM,
+    LASTSENSOR
 } Sensor;
 
 static Sensors sensors[] = {
-    {_SYSBASENAME_VIA, _CPUTEMPINP},
-    {_SYSBASENAME_VIA, _CPUTEMPMAX},
-    {_SYSBASENAME_VIA, _SYSTEMPINP},
-    {_SYSBASENAME_VIA, _SYSTEMPMAX},
-    {_SYSBASENAME_VIA, _SYSFANINP},
-    {_SYSBASENAME_VIA, _CPUFANINP}
+    {_SYSBASENAME_VIA, _CPUTEMPINP, -1},
+    {_SYSBASENAME_VIA, _CPUTEMPMAX, -1},
+    {_SYSBASENAME_VIA, _SYSTEMPINP, -1},
+    {_SYSBASENAME_VIA, _SYSTEMPMAX, -1},
+    {_SYSBASENAME_VIA, _SYSFANINP, -1},
+    {_SYSBASENAME_VIA, _CPUFANINP, -1},
+    {NULL, NULL, -1},	/* the via686a has no pwm channels */
+    {NULL, NULL, -1}
+};
+
+/* chips we know, with the attribute for each of our sensors */
+typedef struct {
+    const char *chip;	/* contents of the hwmon name file */
+    const char *attr[LASTSENSOR];
+} Chip;
+
+static const Chip chips[] = {
+    {"via686a", {_CPUTEMPINP, _CPUTEMPMAX, _SYSTEMPINP, _SYSTEMPMAX,
+		 _SYSFANINP, _CPUFANINP, NULL, NULL}},
+    {"lm80", {_CPUTEMPINP, _CPUTEMPMAX, _SYSTEMPINP, _SYSTEMPMAX,
+	      _SYSFANINP, _CPUFANINP, NULL, NULL}},
 };
 
 /* special escape sequences for the SG30 LCD */
@@ -135,13 +212,26 @@ const char clearDsp[] = "\033X";
 const char darkDsp[] = "\033F";
 const char lightDsp[] = "\033b";
 const char pwrDownDsp[] = "\033%dq"; /* in %d seconds */
+/* escape to move the cursor to row %d, column %d - we know of none */
+/* for the SG30, so changed frames are redrawn whole; define it for a */
+/* panel that has one and only the changed characters are sent */
+/* #define CURSORDSP "\033%d;%dH" */
+/* escape to load custom character %d with eight rows of five pixels - */
+/* unknown for the SG30 too, so the sparklines of the trend pages use */
+/* plain characters; define it and GLYPHBASE for a panel that has one */
+/* #define GLYPHDSP "\033%dG" */
+/* #define GLYPHBASE 8 */
 
 
 /* possible buttons */
 typedef enum {
     POWERBUTTON = 'A',
     SELECTBUTTON = 'S',
-    TIMEOUT = 0
+    TIMEOUT = 0,
+    REFRESH = 1,	/* not a button, new data for the current page */
+    POWERTWICE = 2,	/* gesture: power twice, power off */
+    POWERSELECT = 3,	/* gesture: power then select, restart */
+    SELECTLONG = 4	/* gesture: select held down */
 } Button;
 
 /* display on or off state */
@@ -155,14 +245,19 @@ typedef enum {
 typedef enum {
   DATETIME,      /* show current date and time */
   TEMPS,         /* show system temperatures */
+  TEMPTREND,	 /* show 24 hour temperature history */
   FANS,          /* show fan speeds */
+  FANTREND,	 /* show 24 hour fan speed history */
   FANCTL,        /* allow fan control */
   DISKTEMPS,     /* show hard disk temperatures if supported by drive(s) */
   EXTADDR,       /* show ip address of connection (as seen on internet) */
   LANADDR,       /* show ip addresses for ETH0 and ETH1 */
   UPTIME,        /* show system uptime */
   FIREWALLCTL,   /* show status of firewall and allow toggling */
-  WLANCTL        /* show status of wireless and allow toggling */   
+  WLANCTL,	 /* show status of wireless and allow toggling */
+  LASTDISPLAY,	 /* end of the cycle, not a page */
+  MESSAGE,	 /* text sent by a client, shown until a button is pressed */
+  JOB		 /* progress of a firewall or WLAN command */
 } Display;
 
 /* Fan control */
@@ -183,6 +278,11 @@ typedef enum {
     CONTROLLED
 } FanControl;
 
+typedef struct {
+    int temp;
+    int duty;
+} CurvePoint;
+
 typedef struct {
     char *name;
     FanMode mode;
@@ -190,624 +290,5215 @@ typedef struct {
     int temp;
     int tempOn;
     int tempOff;
+    Sensor pwm;			/* its pwm channel */
+    int enable;			/* pwmN_enable we found, -1 if not taken over */
+    int duty;			/* last written, -1 if switched by the port */
+    double integral;		/* of the error, degree seconds */
+    long long written;		/* when the duty was last written */
+    CurvePoint curve[MAXCURVE]; /* duty for a temperature, rising, -C sets it */
+    int points;
 } Fan;
 
 
 static Fan fan[LASTFAN];
 
-static int lcdfd = 0, terminating = 0;
+static int lcdfd = 0;
+static volatile sig_atomic_t terminating = 0, termSignal = 0;
 static FanControl fanControl;
 
+/* the server's own counters, for the metrics file */
+static struct {
+    unsigned long long loops;		/* event loop iterations */
+    unsigned long long serialBytes;	/* written to the LCD */
+    unsigned long long forks;		/* collectors and jobs started */
+    unsigned long long collections;	/* collector runs finished */
+    long long collectUs;		/* their time from start to end */
+    unsigned long long thermalMissed;	/* thermal checks run late */
+    unsigned long long fanWrites;	/* pwm and fan register writes */
+} counters;
 
-static char *readSys(Sensor sensor)
-{
-    char pathname[255];
-    static char buf[255];
-    int fd, res;
+/* latency probes on the server's hot path: log2 histograms of */
+/* microseconds, cheap enough to stay on, written out on SIGUSR1 */
 
-    strcpy(pathname, sensors[sensor].base);
-    strcat(pathname, sensors[sensor].name);
+#define HISTBUCKETS 32		/* bucket i counts up to 2^i us */
+#define THERMALSLACK 1000	/* ms a thermal check may be late */
 
-    /* read information from system (/sys) */
-    fd = open(pathname, O_RDONLY | O_NOCTTY); 
-    if (fd > 0) {
-	res = read(fd, buf, sizeof(buf));
-	close(fd);
-    } else {
-	/* return empty string on error */
-	res = 0;
+typedef struct {
+    unsigned long long count;
+    long long sum, max;		/* microseconds */
+    unsigned long long bucket[HISTBUCKETS];
+} Histogram;
+
+typedef enum {
+    PROBE_WAKEUP = 0,	/* a timer was due until its handler ran */
+    PROBE_FANS,		/* controlFans() */
+    PROBE_DRAW,		/* writeLcd() */
+    PROBE_DRAIN,	/* output queued until the UART took the last byte */
+    PROBE_BUTTON,	/* button read until the answer was written */
+    LASTPROBE
+} ProbeId;
+
+static const char *probeNames[LASTPROBE] = {
+    "wakeup", "fans", "draw", "drain", "button"
+};
+
+static Histogram probes[LASTPROBE];
+static volatile sig_atomic_t probeDump = 0;
+static const char *probeFile;		/* NULL for syslog, set by -l */
+static const char *recordFile;		/* trace to record, set by -r */
+
+static long long nowUs(void);
+
+static void recordLatency(Histogram *h, long long us)
+{
+    int i = 0;
+
+    if (us < 0) {
+	us = 0;
     }
-    if ((res > 0) && (buf[res-1] == '\n')) {
-	res--;
+    if (us > 0) {
+	i = min(64 - __builtin_clzll(us), HISTBUCKETS - 1);
     }
-    buf[res] = 0;
-    return buf;
+    h->bucket[i]++;
+    h->count++;
+    h->sum += us;
+    h->max = max(h->max, us);
 }
 
-static int readSysTemp(Sensor sensor)
+/* upper bound of the bucket holding the given fraction of the samples */
+static long long percentile(const Histogram *h, double p)
 {
-    /* temperatures are stored in 1/1000 degrees */
-    return (atoi(readSys(sensor))+500) / 1000 ;
+    unsigned long long n = 0, want = h->count * p;
+    int i;
+
+    for (i = 0; i < HISTBUCKETS - 1; i++) {
+	n += h->bucket[i];
+	if (n > want) {
+	    break;
+	}
+    }
+    return min(1LL << i, h->max);
 }
 
+/* traces: with -r the server records what it reads from and writes */
+/* to the panel, every sensor sample, every wall clock reading and */
+/* the collectors' results, each stamped with the monotonic clock. */
+/* "lcd replay" feeds a trace back on a virtual clock, as fast as */
+/* the server can take it. The header is the magic, the monotonic */
+/* start and the options as a varint length and, for each, its letter */
+/* and argument up to a NUL. A record is its type, the microseconds */
+/* since the previous record and the payload length as varints, */
+/* then the payload. */
 
-static void initFanControl(void)
+#define TRACEMAGIC "LCDTRAC2"
+#define TRACEBUFFER 65536
+#define TRACEOPTIONS "faepiCs"	/* the options that change the output */
+
+typedef enum {
+    TRACE_OFF = 0,
+    TRACE_RECORD,
+    TRACE_REPLAY
+} TraceMode;
+
+typedef enum {
+    TRACE_IN = 1,	/* bytes read from the panel */
+    TRACE_OUT,		/* bytes written to the panel */
+    TRACE_SENSOR,	/* sensor, 1 if it was there, zigzag varint value */
+    TRACE_CLOCK,	/* clock, varint microseconds */
+    TRACE_COLLECT,	/* collector, its result */
+    TRACE_DISKS,	/* MAXDISKS NUL terminated names, empty if free */
+    TRACE_HISTORY,	/* varint bucket index and the bucket, for each in use */
+    TRACE_ADDRESS,	/* the external address just looked up, empty if none */
+    TRACE_LOOKUP	/* a lookup of the external address starts */
+} TraceType;
+
+typedef enum {
+    TRACECLOCK_REALTIME = 0,
+    TRACECLOCK_BOOTTIME,
+    LASTTRACECLOCK
+} TraceClock;
+
+typedef struct {
+    size_t pos;		/* of the next record */
+    long long stamp;	/* of the record before */
+} TraceCursor;
+
+typedef struct {
+    TraceType type;
+    long long stamp;	/* monotonic microseconds */
+    const unsigned char *data;
+    size_t len;
+} TraceRecord;
+
+static struct {
+    TraceMode mode;
+    FILE *f;			/* the trace being recorded */
+    long long last;		/* stamp of its last record */
+    unsigned char *buf;		/* the trace being replayed */
+    size_t len;
+    TraceCursor at;		/* the next record to play */
+    long long now;		/* the virtual monotonic clock */
+    long long offset[LASTTRACECLOCK];	/* other clocks minus monotonic */
+    struct {
+	int ok;
+	long value;
+    } sensors[LASTSENSOR];
+    unsigned char *out;		/* all recorded output, in order */
+    size_t outLen, outPos;	/* and how much the replay matched */
+    long long diverged;		/* when the output first differed, -1 if not */
+    char options[512];		/* of the recorded session */
+    size_t optionsLen;
+    size_t first;		/* where the records start */
+} trace = {TRACE_OFF, NULL, 0, NULL, 0, {0, 0}, 0, {0}, {{0}}, NULL, 0, 0, -1};
+
+static int putVarint(unsigned char *p, unsigned long long v)
 {
-    fanControl = CONTROLLED;
+    int n = 0;
 
-#ifdef __FreeBSD__
-    open("/dev/io", O_RDONLY, 0);
-#else
-    setuid(0);
-    if (iopl(3)) {
-	perror("iopl()");
-        fanControl = UNAVAILABLE;
+    while (v >= 0x80) {
+	p[n++] = v | 0x80;
+	v >>= 7;
     }
-#endif
-    fan[CPUFAN].name = "CPU";
-    fan[CPUFAN].mode = FANON;
-    fan[CPUFAN].readtemp = CPUTEMPINP;
-    fan[CPUFAN].temp = readSysTemp(fan[CPUFAN].readtemp);
-    fan[CPUFAN].tempOn = readSysTemp(CPUTEMPMAX);
-    fan[CPUFAN].tempOff = fan[CPUFAN].tempOn - CPUTEMPHYST;
+    p[n++] = v;
+    return n;
+}
 
-    fan[SYSFAN].name = "SYS";
-    fan[SYSFAN].mode = FANON;
-    fan[SYSFAN].readtemp = SYSTEMPINP;
-    fan[SYSFAN].temp = readSysTemp(fan[SYSFAN].readtemp);
-    fan[SYSFAN].tempOn = readSysTemp(SYSTEMPMAX);
-    fan[SYSFAN].tempOff = fan[SYSFAN].tempOn - SYSTEMPHYST;
-#if DEB
-    if (fanControl == UNAVAILABLE) {
-	fprintf(stderr, "Fan control unavailable\n");
-    } else {
-	FanType f;
-	for (f = CPUFAN; f < LASTFAN; f++) {
-	    fprintf(stderr, "%s temp %d, fan on at %d, fan off at %d\n",
-		    fan[f].name, fan[f].temp, fan[f].tempOn, fan[f].tempOff);
+/* 0 if the varint runs past the end */
+static int getVarint(const unsigned char *p, size_t len, unsigned long long *v)
+{
+    int n = 0, shift = 0;
+
+    *v = 0;
+    while (n < len && n < 10) {
+	*v |= (unsigned long long) (p[n] & 0x7f) << shift;
+	shift += 7;
+	if ((p[n++] & 0x80) == 0) {
+	    return n;
 	}
     }
-#endif
-}    
+    return 0;
+}
 
-static void toggleFan(FanType fant, FanMode mode)
+static void traceRecord(TraceType type, const void *data, size_t len)
 {
-    unsigned long FANCTLPORT = 0x404C;
+    unsigned char head[24];
+    struct timespec ts;
+    long long stamp;
+    int n;
 
-    mode ? OUTL(inl(FANCTLPORT) & ~(1<<(12+fant)), FANCTLPORT) : 
-	OUTL(inl(FANCTLPORT) | (1<<(12+fant)), FANCTLPORT); 
-    fan[fant].mode = mode;
-#if DEB
-    fprintf(stderr, "Turning %s fan %s\n", 
-	    fan[fant].name, mode == FANON? "on": "off");
-#endif
+    if (trace.mode != TRACE_RECORD || trace.f == NULL) {
+	return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    stamp = (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    head[0] = type;
+    n = 1 + putVarint(head + 1, max(stamp - trace.last, 0));
+    n += putVarint(head + n, len);
+    trace.last = max(stamp, trace.last);
+    fwrite(head, 1, n, trace.f);
+    fwrite(data, 1, len, trace.f);
 }
 
-static void controlFans(void)
+/* start recording to a file, 0 on error */
+static int openTrace(const char *pathname)
 {
-    FanType f;
+    struct timespec ts;
+    long long start;
+    unsigned char head[10];
 
-    if (fanControl == CONTROLLED) {
-	for (f = CPUFAN; f < LASTFAN; f++) {
-	    fan[f].temp = readSysTemp(fan[f].readtemp);
-	    if (fan[f].mode == FANON) {
-		/* the fan is on */
-		if (fan[f].temp <= fan[f].tempOff) {
-		    /* it's cool again */
-		    toggleFan(f, FANOFF);
-		}
-	    } else {
-		/* it's getting too warm */
-		if (fan[f].temp > fan[f].tempOn) {
-		    /* temperature went up */
-		    toggleFan(f, FANON);
-		}
-	    }
-	}
+    trace.f = fopen(pathname, "w");
+    if (trace.f == NULL) {
+	perror(pathname);
+	return 0;
     }
+    setvbuf(trace.f, NULL, _IOFBF, TRACEBUFFER);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    start = (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    fwrite(TRACEMAGIC, 1, 8, trace.f);
+    fwrite(&start, sizeof(start), 1, trace.f);
+    fwrite(head, 1, putVarint(head, trace.optionsLen), trace.f);
+    fwrite(trace.options, 1, trace.optionsLen, trace.f);
+    trace.last = start;
+    trace.mode = TRACE_RECORD;
+    return 1;
 }
 
-static void finishFanControl(FanMode mode)
+/* keep an option that changes the output for the trace header */
+static void keepOption(int opt, const char *arg)
 {
-    FanType f;
+    size_t n = strlen(arg) + 2;
 
-    if (fanControl != UNAVAILABLE) {
-	/* always turn on both fans */
-	for (f = CPUFAN; f < LASTFAN; f++) {
-	    toggleFan(f, mode);
+    if (strchr(TRACEOPTIONS, opt) == NULL ||
+	trace.optionsLen + n > sizeof(trace.options)) {
+	return;
+    }
+    trace.options[trace.optionsLen] = opt;
+    memcpy(trace.options + trace.optionsLen + 1, arg, n - 1);
+    trace.optionsLen += n;
+}
+
+static void closeTrace(void)
+{
+    if (trace.f != NULL) {
+	fclose(trace.f);
+	trace.f = NULL;
+    }
+}
+
+/* every clock the server reads goes through here, in microseconds */
+static long long clockUs(clockid_t clock)
+{
+    struct timespec ts;
+    unsigned char rec[12];
+    TraceClock tc = clock == CLOCK_REALTIME ? TRACECLOCK_REALTIME :
+	TRACECLOCK_BOOTTIME;
+    long long us;
+
+    if (trace.mode == TRACE_REPLAY) {
+	return clock == CLOCK_MONOTONIC ? trace.now : trace.now + trace.offset[tc];
+    }
+    clock_gettime(clock, &ts);
+    us = (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    if (clock != CLOCK_MONOTONIC && trace.mode == TRACE_RECORD) {
+	rec[0] = tc;
+	traceRecord(TRACE_CLOCK, rec, 1 + putVarint(rec + 1, us));
+    }
+    return us;
+}
+
+/* seconds since boot */
+static long uptimeSeconds(void)
+{
+    return clockUs(CLOCK_BOOTTIME) / 1000000;
+}
+
+
+/* read the first line of a small file, 0 if there is none */
+static int readLine(const char *pathname, char *buf, int len)
+{
+    int fd, res;
+
+    fd = open(pathname, O_RDONLY | O_NOCTTY | O_CLOEXEC);
+    if (fd < 0) {
+	return 0;
+    }
+    res = read(fd, buf, len - 1);
+    close(fd);
+    if (res <= 0) {
+	return 0;
+    }
+    buf[res] = 0;
+    buf[strcspn(buf, "\n")] = 0;
+    return 1;
+}
+
+static void setSensor(Sensor sensor, const char *dir, const char *attr)
+{
+    if (sensors[sensor].path[0] == 0) {
+	snprintf(sensors[sensor].path, sizeof(sensors[sensor].path),
+		 "%.90s/%.32s", dir, attr);
+	if (access(sensors[sensor].path, F_OK) != 0) {
+	    sensors[sensor].path[0] = 0;
 	}
     }
 }
 
-static void signalHandler(int sig)
+/* use channel labels like "CPU Temp" or "SYS Fan" if the chip has them */
+static void matchLabels(const char *dir)
 {
-    terminating = 1;
-    if (sig == SIGTERM || sig == SIGKILL) {
-	/* terminating signal received */
-	if (lcdfd != 0) {
-	    /* if user initiated shutdown */
-	    /* powerdown in some seconds */
-	    char tmp[sizeof(pwrDownDsp)+12];
-	    sprintf(tmp, pwrDownDsp, POWERDOWNWAIT);
-    	    write(lcdfd, tmp, strlen(tmp));
-	} 
+    char pathname[128], label[32], inp[32], max[32], pwm[32];
+    int n;
+
+    for (n = 1; n <= 8; n++) {
+	sprintf(inp, "temp%d_input", n);
+	sprintf(max, "temp%d_max", n);
+	snprintf(pathname, sizeof(pathname), "%.90s/temp%d_label", dir, n);
+	if (readLine(pathname, label, sizeof(label))) {
+	    if (strcasestr(label, "CPU") != NULL) {
+		setSensor(CPUTEMPINP, dir, inp);
+		setSensor(CPUTEMPMAX, dir, max);
+	    } else if (strcasestr(label, "SYS") != NULL ||
+		       strcasestr(label, "board") != NULL) {
+		setSensor(SYSTEMPINP, dir, inp);
+		setSensor(SYSTEMPMAX, dir, max);
+	    }
+	}
+	sprintf(inp, "fan%d_input", n);
+	sprintf(pwm, "pwm%d", n);
+	snprintf(pathname, sizeof(pathname), "%.90s/fan%d_label", dir, n);
+	if (readLine(pathname, label, sizeof(label))) {
+	    if (strcasestr(label, "CPU") != NULL) {
+		setSensor(CPUFANINP, dir, inp);
+		setSensor(CPUFANPWM, dir, pwm);
+	    } else if (strcasestr(label, "SYS") != NULL ||
+		       strcasestr(label, "chassis") != NULL) {
+		setSensor(SYSFANINP, dir, inp);
+		setSensor(SYSFANPWM, dir, pwm);
+	    }
+	}
     }
 }
 
-static void writeLcd(int fd, char *line1, char *line2) 
+/* build the sensor index from /sys/class/hwmon */
+static void discoverSensors(void)
 {
+    char dirname[96], pathname[128], chip[32];
+    DIR *dir;
+    struct dirent *de;
+    Sensor s;
     int i;
-    char display [60];
 
+    dir = opendir(hwmonClass);
+    while (dir != NULL && (de = readdir(dir)) != NULL) {
+	if (strncmp(de->d_name, "hwmon", 5) != 0) {
+	    continue;
+	}
+	/* older drivers keep their attributes in the device directory */
+	snprintf(dirname, sizeof(dirname), "%.48s/%.32s", hwmonClass, de->d_name);
+	snprintf(pathname, sizeof(pathname), "%s/name", dirname);
+	if (!readLine(pathname, chip, sizeof(chip))) {
+	    snprintf(dirname, sizeof(dirname), "%.48s/%.32s/device", hwmonClass, de->d_name);
+	    snprintf(pathname, sizeof(pathname), "%s/name", dirname);
+	    if (!readLine(pathname, chip, sizeof(chip))) {
+		continue;
+	    }
+	}
+	matchLabels(dirname);
+	for (i = 0; i < sizeof(chips) / sizeof(chips[0]); i++) {
+	    if (strcmp(chip, chips[i].chip) != 0) {
+		continue;
+	    }
+	    for (s = 0; s < LASTSENSOR; s++) {
+		if (chips[i].attr[s] != NULL) {
+		    setSensor(s, dirname, chips[i].attr[s]);
+		}
+	    }
+	}
+    }
+    if (dir != NULL) {
+	closedir(dir);
+    }
+    for (s = 0; s < LASTSENSOR; s++) {
+	if (sensors[s].path[0] == 0 && sensors[s].base != NULL) {
+	    snprintf(sensors[s].path, sizeof(sensors[s].path), "%s%s",
+		     sensors[s].base, sensors[s].name);
+	}
 #if DEB
-    fprintf(stderr, "%s %s\n", line1, line2);
+	fprintf(stderr, "sensor %d: %s\n", s, sensors[s].path);
 #endif
-    /* clear display */
-    strcpy(display, clearDsp);
+    }
+}
 
-    /* write both lines centered */
-    if (line1 != NULL) {
-	int l = (LINELEN - min(strlen(line1), LINELEN)) / 2;
-	for (i=0; i < l; i++) {
-	    strcat(display, " ");
-	}
-	strncat(display, line1, LINELEN);
+/* the sensor was there when it was last read */
+static int sensorPresent(Sensor sensor)
+{
+    if (trace.mode == TRACE_REPLAY) {
+	return trace.sensors[sensor].ok;
     }
-    strcat(display, "\n");
-    if (line2 != NULL) {
-	int l = (LINELEN - min(strlen(line2), LINELEN)) / 2;
-	for (i=0;  i < l; i++) {
-	    strcat(display, " ");
-	}
-	strncat(display, line2, LINELEN);
+    return sensors[sensor].fd >= 0;
+}
+
+static void traceSensor(Sensor sensor, long value)
+{
+    unsigned char rec[12];
+
+    if (trace.mode == TRACE_RECORD) {
+	rec[0] = sensor;
+	rec[1] = sensors[sensor].fd >= 0;
+	/* zigzag, so a small negative value stays short */
+	traceRecord(TRACE_SENSOR, rec, 2 + putVarint(rec + 2,
+	    ((unsigned long long) value << 1) ^ (value < 0 ? ~0ULL : 0)));
     }
-    write(fd, display, strlen(display)); 
 }
 
-static int waitFor(int fd, int waitSecs)
+/* a reloaded driver may come back as another hwmonN, so the sensors */
+/* that can't be opened are looked for again, at most every REDISCOVER */
+static int rediscoverSensors(void)
 {
-    int rc;
-    struct timeval timeout;
-    fd_set readfds;
+    static long long last = -REDISCOVER * 1000LL;
+    long long now = clockUs(CLOCK_MONOTONIC) / 1000;
+    Sensor s;
 
-    FD_ZERO(&readfds);
-    FD_SET(fd, &readfds);
-    if (waitSecs >= 0) {
-        /* wait for specified number of seconds */
-	timeout.tv_sec = waitSecs;
-	timeout.tv_usec = 0;
-	rc = select(fd+1, &readfds, NULL, NULL, &timeout);
-    } else {
-	/* wait forever */
-	rc = select(fd+1, &readfds, NULL, NULL, NULL);
+    if (now - last < REDISCOVER * 1000LL) {
+	return 0;
     }
-    if (rc < 0) {
-    	rc = 0;
+    last = now;
+    for (s = 0; s < LASTSENSOR; s++) {
+	if (sensors[s].fd < 0) {
+	    sensors[s].path[0] = 0;
+	}
     }
-    return rc;
+    discoverSensors();
+    return 1;
 }
 
-static Button readButton(int fd, int wait) 
+static int openSys(Sensor sensor)
 {
-    int res;
-    char buf[20];
+    sensors[sensor].fd = open(sensors[sensor].path, O_RDONLY | O_NOCTTY | O_CLOEXEC);
+    return sensors[sensor].fd;
+}
 
-    while (1) {		
-	/* wait for input */
-	if (waitFor(fd, wait)) {
-	    res = read(fd, buf, sizeof(buf));
-	    buf[res] = 0;  
-	    return buf[0];
-	} else {
-	    return TIMEOUT;
+/* read a number from the system (/sys), 0 on error */
+static long readSys(Sensor sensor)
+{
+    char buf[32];
+    int res = -1, tries;
+    long value;
+
+    if (trace.mode == TRACE_REPLAY) {
+	return trace.sensors[sensor].value;
+    }
+    /* the file stays open, a sample is a single pread() */
+    for (tries = 0; tries < 2 && res < 0; tries++) {
+	if (sensors[sensor].fd < 0 && openSys(sensor) < 0 &&
+	    (!rediscoverSensors() || openSys(sensor) < 0)) {
+	    return 0;
 	}
+	res = pread(sensors[sensor].fd, buf, sizeof(buf) - 1, 0);
+	if (res < 0) {
+	    /* the driver may have been reloaded, open the file again */
+	    close(sensors[sensor].fd);
+	    sensors[sensor].fd = -1;
+	}
+    }
+    value = 0;
+    if (res > 0) {
+	buf[res] = 0;
+	value = strtol(buf, NULL, 10);
     }
+    traceSensor(sensor, value);
+    return value;
 }
 
+static int readSysTemp(Sensor sensor)
+{
+    /* temperatures are stored in 1/1000 degrees */
+    return (readSys(sensor)+500) / 1000 ;
+}
+
+/* sensor history: every series keeps rings of buckets at one second, */
+/* one minute and one hour. A sample goes into the current bucket of */
+/* each ring; a bucket left over from an earlier round is cleared */
+/* first, so memory is fixed and an insert takes constant time. The */
+/* rings live in a mapped file and survive a restart. */
+
+#define HISTORYMAGIC "LCDHIST1"
+#define SECONDSLOTS 120		/* two minutes */
+#define MINUTESLOTS 1440	/* a day */
+#define HOURSLOTS 168		/* a week */
+#define HISTORYSLOTS (SECONDSLOTS + MINUTESLOTS + HOURSLOTS)
+#define SPARKLEVELS 4
+
 typedef enum {
-    MODE_NONE = 0,
-    MODE_POWEROFF,
-    MODE_FANOFF,
-    MODE_WLANOFF,
-    MODE_FIREWALL
-} PowerButtonMode;
+    HIST_CPUTEMP = 0,
+    HIST_SYSTEMP,
+    HIST_CPUFAN,
+    HIST_SYSFAN,
+    LASTHISTORY
+} HistoryId;
 
-/* if this file exists then the firewall is on */
-#define FIREWALLSTATUSFILE "/var/tmp/firewall_is_on"
-#define firewall_is_on() (!access(FIREWALLSTATUSFILE, F_OK))
+typedef enum {
+    LEVEL_SECONDS = 0,
+    LEVEL_MINUTES,
+    LEVEL_HOURS,
+    LASTLEVEL
+} HistoryLevel;
 
-static void server(int fd)
-{
-    int n, wait, fani, firewall, wlan;
-    PowerButtonMode powerButtonMode;
-    time_t t;
-    struct tm *tm;
-    char tmp1[50], tmp2[50];
-    struct sysinfo info;
-    int updays, uphours, upminutes;
-    FILE *f;
-    Darkness darkness;
-    Display display;
+typedef struct {
+    int period;		/* time / step of the bucket's interval */
+    int min, max, sum, count;
+} Bucket;
 
-    signal(SIGTERM, signalHandler);
-    signal(SIGHUP, signalHandler);
-    signal(SIGINT, signalHandler);
-    signal(SIGQUIT, signalHandler);
-    signal(SIGKILL, signalHandler);
-    signal(SIGSEGV, signalHandler);
-    signal(SIGBUS, signalHandler);
+typedef struct {
+    char magic[8];
+    int size;		/* of the whole file, a changed layout starts over */
+    int unused;
+    Bucket buckets[LASTHISTORY][HISTORYSLOTS];
+} History;
 
-    display = DATETIME;
-    powerButtonMode = MODE_NONE;
-    darkness = LIGHT;
-    wait = 0;
-    wlan = 1;
+static const struct {
+    int step;		/* seconds per bucket */
+    int first;		/* first slot of the ring */
+    int slots;
+} levels[LASTLEVEL] = {
+    {1, 0, SECONDSLOTS},
+    {60, SECONDSLOTS, MINUTESLOTS},
+    {3600, SECONDSLOTS + MINUTESLOTS, HOURSLOTS},
+};
 
-    while (!terminating) {
-	Button button = readButton(fd, wait);
+static const Sensor historySensors[LASTHISTORY] = {
+    CPUTEMPINP, SYSTEMPINP, CPUFANINP, SYSFANINP
+};
 
-	/* fan control */
-	controlFans();
+#ifdef GLYPHDSP
+static const char sparkChars[SPARKLEVELS + 1] = {
+    GLYPHBASE, GLYPHBASE + 2, GLYPHBASE + 4, GLYPHBASE + 7, 0
+};
+#else
+static const char sparkChars[SPARKLEVELS + 1] = "_.-^";
+#endif
 
-	/* get the current time */
-	t = time(NULL);
-	tm = localtime(&t);
+static History *history;
+static const char *historyFile;		/* NULL until main() knows the backend */
+static int lastSample[LASTHISTORY];	/* latest readings, -1 if missing */
+static long long lastSampleTime;	/* wall clock ms of them */
 
-	/* control display lighting */
-	if (darkness == WANTSDARK) {
-	    /* switch off display now */
-	    if (button == TIMEOUT) {
-		write(fd, darkDsp, strlen(darkDsp)); 
-		darkness = DARK;
-		display = DATETIME;
-	    }
-	} else {
-	    /* switch on display because somebody pressed a button */
-	    /* or we had a timeout */
-	    write(fd, lightDsp, strlen(darkDsp));
-	    if (darkness == DARK) 
-		darkness = WANTSDARK;
-	}
-	if (tm->tm_hour < DARKUNTIL) {
-	    /* dark between midnight and DARKUNTIL */
-	    if (darkness == LIGHT) {
-		/* we need to switch from light to dark */
-		darkness = WANTSDARK;
-	    }
-	} else {
-	    darkness = LIGHT;
-	}
-#if DEB
-	fprintf(stderr, "button=%d, darkness=%d\n", button, darkness);
+/* the history as the trace starts, so a replay draws the same trends */
+static void traceHistory(void)
+{
+    unsigned char *rec;
+    Bucket *b = &history->buckets[0][0];
+    int i, len = 0;
+
+    if (trace.mode != TRACE_RECORD ||
+	(rec = malloc(LASTHISTORY * HISTORYSLOTS * (sizeof(Bucket) + 4))) == NULL) {
+	return;
+    }
+    for (i = 0; i < LASTHISTORY * HISTORYSLOTS; i++) {
+	if (b[i].count > 0) {
+	    len += putVarint(rec + len, i);
+	    memcpy(rec + len, &b[i], sizeof(Bucket));
+	    len += sizeof(Bucket);
+	}
+    }
+    traceRecord(TRACE_HISTORY, rec, len);
+    free(rec);
+}
+
+static void openHistory(void)
+{
+    int fd = -1;
+    void *map = MAP_FAILED;
+
+    if (trace.mode != TRACE_REPLAY) {
+	/* a replay starts from the trace's history */
+	fd = open(historyFile, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    }
+    if (fd >= 0 && ftruncate(fd, sizeof(History)) == 0) {
+	map = mmap(NULL, sizeof(History), PROT_READ | PROT_WRITE,
+		   MAP_SHARED, fd, 0);
+    }
+    if (map == MAP_FAILED) {
+	/* keep the history in memory only */
+	if (trace.mode != TRACE_REPLAY) {
+	    perror(historyFile);
+	}
+	map = mmap(NULL, sizeof(History), PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (fd >= 0) {
+	close(fd);
+    }
+    if (map == MAP_FAILED) {
+	return;
+    }
+    history = map;
+    if (memcmp(history->magic, HISTORYMAGIC, 8) != 0 ||
+	history->size != sizeof(History)) {
+	memset(history, 0, sizeof(History));
+	memcpy(history->magic, HISTORYMAGIC, 8);
+	history->size = sizeof(History);
+    }
+    traceHistory();
+}
+
+static void closeHistory(void)
+{
+    if (history != NULL) {
+	munmap(history, sizeof(History));
+	history = NULL;
+    }
+}
+
+static void addSample(HistoryId id, int value, time_t t)
+{
+    HistoryLevel l;
+    Bucket *b;
+    int period;
+
+    for (l = 0; l < LASTLEVEL; l++) {
+	period = t / levels[l].step;
+	b = &history->buckets[id][levels[l].first + period % levels[l].slots];
+	if (b->period != period) {
+	    b->period = period;
+	    b->min = b->max = value;
+	    b->sum = b->count = 0;
+	}
+	b->min = min(b->min, value);
+	b->max = max(b->max, value);
+	b->sum += value;
+	b->count++;
+    }
+}
+
+static long long wallMs(void)
+{
+    return clockUs(CLOCK_REALTIME) / 1000;
+}
+
+/* one sample of each sensor, missing sensors leave a gap */
+static void sampleHistory(void)
+{
+    HistoryId id;
+    Sensor sensor;
+    time_t t = wallMs() / 1000;
+    long value;
+
+    lastSampleTime = wallMs();
+    for (id = 0; id < LASTHISTORY; id++) {
+	sensor = historySensors[id];
+	value = id <= HIST_SYSTEMP ? readSysTemp(sensor) : readSys(sensor);
+	lastSample[id] = sensorPresent(sensor) ? value : -1;
+	if (history != NULL && lastSample[id] >= 0) {
+	    addSample(id, value, t);
+	}
+    }
+}
+
+/* the bucket of a level for a period, NULL if it holds no samples */
+static Bucket *findBucket(HistoryId id, HistoryLevel l, int period)
+{
+    Bucket *b = &history->buckets[id][levels[l].first + period % levels[l].slots];
+
+    return b->period == period && b->count > 0 ? b : NULL;
+}
+
+/* min, max and average of the last 24 hours, 0 if there are no samples */
+static int dayStats(HistoryId id, int *lo, int *hi, int *avg)
+{
+    int p, now = wallMs() / 1000 / 3600;
+    long long sum = 0, count = 0;
+    Bucket *b;
+
+    for (p = now - 23; history != NULL && p <= now; p++) {
+	if ((b = findBucket(id, LEVEL_HOURS, p)) != NULL) {
+	    *lo = count == 0 ? b->min : min(*lo, b->min);
+	    *hi = count == 0 ? b->max : max(*hi, b->max);
+	    sum += b->sum;
+	    count += b->count;
+	}
+    }
+    if (count == 0) {
+	return 0;
+    }
+    *avg = (sum + count / 2) / count;
+    return 1;
+}
+
+/* the last 24 hours as LINELEN characters, each the peak of 90 minutes */
+static void sparkline(HistoryId id, int lo, int hi, char *buf)
+{
+    int i, p, peak, seen, now = wallMs() / 1000 / 60;
+    int width = MINUTESLOTS / LINELEN;
+    Bucket *b;
+
+    for (i = 0; i < LINELEN; i++) {
+	seen = 0;
+	peak = lo;
+	for (p = now - (LINELEN - i) * width + 1; p <= now - (LINELEN - 1 - i) * width; p++) {
+	    if ((b = findBucket(id, LEVEL_MINUTES, p)) != NULL) {
+		peak = max(peak, b->max);
+		seen = 1;
+	    }
+	}
+	buf[i] = !seen ? ' ' : hi == lo ? sparkChars[0] :
+	    sparkChars[(peak - lo) * (SPARKLEVELS - 1) / (hi - lo)];
+    }
+    buf[LINELEN] = 0;
+}
+
+#ifdef GLYPHDSP
+/* bars of one to eight rows for the sparklines */
+static void defineGlyphs(int fd)
+{
+    char buf[16];
+    int i, row;
+
+    for (i = 0; i < 8; i++) {
+	int n = sprintf(buf, GLYPHDSP, GLYPHBASE + i);
+	for (row = 0; row < 8; row++) {
+	    buf[n++] = row >= 7 - i ? 0x1f : 0;
+	}
+	write(fd, buf, n);
+    }
+}
+#endif
+
+/* the trend page of a series: min/max/avg, then the sparkline */
+static void trendLines(HistoryId id, const char *name, char *line1, char *line2)
+{
+    int lo, hi, avg, temp = id <= HIST_SYSTEMP;
+
+    if (!dayStats(id, &lo, &hi, &avg)) {
+	sprintf(line1, "%s", name);
+	strcpy(line2, "no history");
+	return;
+    }
+    sparkline(id, lo, hi, line2);
+    if (temp && tempunit == FAHRENHEIT) {
+	lo = ((float)lo * 1.8) + 32;
+	hi = ((float)hi * 1.8) + 32;
+	avg = ((float)avg * 1.8) + 32;
+    }
+    sprintf(line1, "%s %d/%d/%d%s", name, lo, hi, avg, temp ? "" : "");
+    if (strlen(line1) > LINELEN) {
+	/* big fan speeds, the initial has to do */
+	sprintf(line1, "%c %d/%d/%d", name[0], lo, hi, avg);
+    }
+}
+
+/* backends: where the panel link, the sensors and the fan register */
+/* are. "hardware" is the SG30 itself; "sim" runs anywhere without */
+/* privileges, with a pty for the panel, a made up hwmon tree and the */
+/* fan register in memory, so the server can be tried and measured. */
+
+#define FANCTLPORT 0x404C	/* bits 12 and 13 switch the fans off */
+#define SIMDIR "/tmp/lcd-sim"	/* default directory of the sim backend */
+#define SIMDRAIN 2000		/* ms the sim panel gets to read the last frames */
+
+typedef struct {
+    const char *name;
+    int (*init)(void);			/* 0 if the backend can't be used */
+    int (*openLcd)(void);		/* the panel link, -1 on error */
+    void (*closeLcd)(int fd);
+    int (*initFans)(void);		/* 0 if the fans can't be switched */
+    unsigned long (*readFans)(void);	/* the fan control register */
+    void (*writeFans)(unsigned long value);
+    void (*power)(int reboot);		/* shut the machine down */
+    pid_t (*spawnJob)(char *const argv[]);  /* -1 on error */
+    const char *controlSocket;		/* default socket, NULL for ours */
+    const char *snapshot;		/* default files, NULL for ours */
+    const char *history;
+    const char *firewall;
+} Backend;
+
+static int hwInit(void)
+{
+    return 1;
+}
+
+static int hwOpenLcd(void)
+{
+    int fd = open(LCDDEVICE, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+
+    if (fd < 0) {
+	perror(LCDDEVICE);
+    }
+    return fd;
+}
+
+static void hwCloseLcd(int fd)
+{
+    close(fd);
+}
+
+static int hwInitFans(void)
+{
+#ifdef __FreeBSD__
+    open("/dev/io", O_RDONLY, 0);
+#else
+    setuid(0);
+    if (iopl(3)) {
+	perror("iopl()");
+	return 0;
+    }
+#endif
+    return 1;
+}
+
+static unsigned long hwReadFans(void)
+{
+    return inl(FANCTLPORT);
+}
+
+static void hwWriteFans(unsigned long value)
+{
+    OUTL(value, FANCTLPORT);
+}
+
+static void hwPower(int reboot)
+{
+    system(reboot ? "shutdown -r now" : "shutdown -h now");
+    /* wait for SIGTERM */
+    sleep(120);
+}
+
+/* a job runs in its own process group, so a timeout stops the whole script */
+static pid_t hwSpawnJob(char *const argv[])
+{
+    posix_spawnattr_t attr;
+    pid_t pid;
+    int res;
+
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setpgroup(&attr, 0);
+    res = posix_spawnp(&pid, argv[0], NULL, &attr, argv, environ);
+    posix_spawnattr_destroy(&attr);
+    if (res != 0) {
+	fprintf(stderr, "%s: %s\n", argv[0], strerror(res));
+	return -1;
+    }
+    return pid;
+}
+
+static char simDir[96] = SIMDIR;
+static char simHwmon[128], simPanel[128], simSocket[128];
+static char simSnapshot[128], simHistory[128], simFirewall[128];
+static int simSlave = -1;	/* kept open so the pty never hangs up */
+static unsigned long simFans;
+
+/* made up readings of the via686a, in the order of the Sensor enum */
+static const long simValues[LASTSENSOR] = {
+    45000, 60000, 38000, 50000, 2400, 3000, 0, 0
+};
+
+/* labels and pwm channels the via686a lacks, so the sim has them */
+static const char *const simExtras[][2] = {
+    {"fan1_label", "CPU Fan"}, {"fan2_label", "SYS Fan"},
+    {"pwm1", "255"}, {"pwm2", "255"},
+    {"pwm1_enable", "2"}, {"pwm2_enable", "2"},
+};
+
+/* a hwmon tree with one via686a; files that are there are kept, */
+/* so a test can change a reading and restart the server */
+static int simInit(void)
+{
+    char pathname[192];
+    FILE *f;
+    int s;	/* -1 is the name file */
+
+    snprintf(simHwmon, sizeof(simHwmon), "%.90s/hwmon", simDir);
+    snprintf(simPanel, sizeof(simPanel), "%.90s/panel", simDir);
+    snprintf(simSocket, sizeof(simSocket), "%.90s/lcd.sock", simDir);
+    snprintf(simSnapshot, sizeof(simSnapshot), "%.90s/shm", simDir);
+    snprintf(simHistory, sizeof(simHistory), "%.90s/history", simDir);
+    snprintf(simFirewall, sizeof(simFirewall), "%.90s/firewall_is_on", simDir);
+    mkdir(simDir, 0755);
+    mkdir(simHwmon, 0755);
+    snprintf(pathname, sizeof(pathname), "%s/hwmon0", simHwmon);
+    if (mkdir(pathname, 0755) < 0 && errno != EEXIST) {
+	perror(pathname);
+	return 0;
+    }
+    for (s = -1; s < LASTSENSOR; s++) {
+	if (s >= 0 && chips[0].attr[s] == NULL) {
+	    continue;
+	}
+	snprintf(pathname, sizeof(pathname), "%s/hwmon0/%s", simHwmon,
+		 s < 0 ? "name" : chips[0].attr[s]);
+	if (access(pathname, F_OK) == 0 || (f = fopen(pathname, "w")) == NULL) {
+	    continue;
+	}
+	if (s < 0) {
+	    fprintf(f, "%s\n", chips[0].chip);
+	} else {
+	    fprintf(f, "%ld\n", simValues[s]);
+	}
+	fclose(f);
+    }
+    for (s = 0; s < sizeof(simExtras) / sizeof(simExtras[0]); s++) {
+	snprintf(pathname, sizeof(pathname), "%s/hwmon0/%s", simHwmon, simExtras[s][0]);
+	if (access(pathname, F_OK) != 0 && (f = fopen(pathname, "w")) != NULL) {
+	    fprintf(f, "%s\n", simExtras[s][1]);
+	    fclose(f);
+	}
+    }
+    hwmonClass = simHwmon;
+    return 1;
+}
+
+/* lcd holds the master side of a pty, the panel is the slave */
+/* side that dir/panel points to: open it to see the frames */
+/* and write A or S to it to press a button */
+static int simOpenLcd(void)
+{
+    struct termios tio;
+    int fd;
+
+    fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0) {
+	perror("posix_openpt()");
+	return -1;
+    }
+    simSlave = open(ptsname(fd), O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (simSlave >= 0) {
+	tcgetattr(simSlave, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(simSlave, TCSANOW, &tio);
+    }
+    unlink(simPanel);
+    if (symlink(ptsname(fd), simPanel) < 0) {
+	perror(simPanel);
+    }
+    return fd;
+}
+
+static void simCloseLcd(int fd)
+{
+    int i, unread = 0;
+
+    /* give the panel side a moment to read the last frames, */
+    /* a hangup throws away what it has not read */
+    for (i = 0; i < SIMDRAIN / 10; i++) {
+	if (simSlave < 0 || ioctl(simSlave, FIONREAD, &unread) < 0 || unread == 0) {
+	    break;
+	}
+	usleep(10000);
+    }
+    unlink(simPanel);
+    if (simSlave >= 0) {
+	close(simSlave);
+	simSlave = -1;
+    }
+    close(fd);
+}
+
+static int simInitFans(void)
+{
+    return 1;
+}
+
+static unsigned long simReadFans(void)
+{
+    return simFans;
+}
+
+static void simWriteFans(unsigned long value)
+{
+    simFans = value;
+}
+
+/* append a line to a file in the sim directory, for a test to read */
+static void simLog(const char *name, const char *line)
+{
+    char pathname[128];
+    FILE *f;
+
+    snprintf(pathname, sizeof(pathname), "%.90s/%s", simDir, name);
+    if ((f = fopen(pathname, "a")) != NULL) {
+	fprintf(f, "%s\n", line);
+	fclose(f);
+    }
+}
+
+/* the machine stays up, dir/power says what would have happened */
+static void simPower(int reboot)
+{
+    simLog("power", reboot ? "reboot" : "halt");
+}
+
+/* the command goes to dir/jobs and true runs in its place */
+static pid_t simSpawnJob(char *const argv[])
+{
+    static char *const trueArgv[] = {"true", NULL};
+    char line[256];
+    int i, len = 0;
+
+    for (i = 0; argv[i] != NULL && len < (int) sizeof(line); i++) {
+	len += snprintf(line + len, sizeof(line) - len, "%s%s",
+			i > 0 ? " " : "", argv[i]);
+    }
+    simLog("jobs", line);
+    return hwSpawnJob(trueArgv);
+}
+
+static const Backend backends[] = {
+    {"hardware", hwInit, hwOpenLcd, hwCloseLcd,
+     hwInitFans, hwReadFans, hwWriteFans, hwPower, hwSpawnJob,
+     NULL, NULL, NULL, NULL},
+    {"sim", simInit, simOpenLcd, simCloseLcd,
+     simInitFans, simReadFans, simWriteFans, simPower, simSpawnJob,
+     simSocket, simSnapshot, simHistory, simFirewall},
+};
+
+static const Backend *backend = &backends[0];
+
+/* choose a backend by name, "sim:dir" also names the directory */
+static int setBackend(const char *arg)
+{
+    int i;
+    size_t n = strcspn(arg, ":");
+
+    for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+	if (strncmp(backends[i].name, arg, n) == 0 &&
+	    backends[i].name[n] == 0) {
+	    backend = &backends[i];
+	    if (arg[n] == ':' && backend->init == simInit) {
+		snprintf(simDir, sizeof(simDir), "%s", arg + n + 1);
+	    }
+	    return 1;
+	}
+    }
+    return 0;
+}
+
+static long long monotonicMs(void);
+
+/* fans without a pwm channel are switched through the fan register; */
+/* we keep a copy of it, so it is read once and written on changes only */
+static int fanPortOk, fanPortKnown;
+static unsigned long fanPort;
+
+/* write a number to a hwmon attribute, 0 on error */
+static int writeAttr(const char *pathname, int value)
+{
+    char buf[16];
+    int fd, len, res;
+
+    if (trace.mode == TRACE_REPLAY) {
+	/* the fans of a replay are imaginary */
+	return 1;
+    }
+    /* truncated, for the plain files of the sim backend */
+    fd = open(pathname, O_WRONLY | O_TRUNC | O_CLOEXEC);
+    if (fd < 0) {
+	return 0;
+    }
+    len = sprintf(buf, "%d\n", value);
+    res = write(fd, buf, len);
+    close(fd);
+    return res == len;
+}
+
+/* take a pwm channel over from the chip's automatic mode, keeping */
+/* the mode it was in for releasePwm */
+static int enablePwm(Fan *p)
+{
+    char pathname[sizeof(sensors[p->pwm].path) + 8], buf[16];
+    int fd, res;
+
+    snprintf(pathname, sizeof(pathname), "%s_enable", sensors[p->pwm].path);
+    fd = open(pathname, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+	return 0;
+    }
+    res = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (res <= 0) {
+	return 0;
+    }
+    buf[res] = 0;
+    if (!writeAttr(pathname, 1)) {
+	return 0;
+    }
+    p->enable = atoi(buf);
+    return 1;
+}
+
+/* give the pwm channels back in the mode we found them in */
+static void releasePwm(void)
+{
+    char pathname[sizeof(sensors[0].path) + 8];
+    FanType f;
+
+    for (f = CPUFAN; f < LASTFAN; f++) {
+	if (fan[f].enable >= 0) {
+	    snprintf(pathname, sizeof(pathname), "%s_enable",
+		     sensors[fan[f].pwm].path);
+	    writeAttr(pathname, fan[f].enable);
+	    fan[f].enable = -1;
+	    fan[f].duty = -1;
+	}
+    }
+}
+
+/* -C cpu=40:64,50:128,60:255, temperature:duty points with rising */
+/* temperatures, 0 if the curve is no good */
+static int setCurve(const char *arg)
+{
+    FanType f;
+    const char *p = arg + 4;
+    int n = 0, t, d, len;
+
+    if (strncmp(arg, "cpu=", 4) == 0) {
+	f = CPUFAN;
+    } else if (strncmp(arg, "sys=", 4) == 0) {
+	f = SYSFAN;
+    } else {
+	return 0;
+    }
+    while (n < MAXCURVE && sscanf(p, "%d:%d%n", &t, &d, &len) == 2) {
+	if (d < 0 || d > PWMMAX || (n > 0 && t <= fan[f].curve[n - 1].temp)) {
+	    return 0;
+	}
+	fan[f].curve[n].temp = t;
+	fan[f].curve[n].duty = d;
+	n++;
+	p += len;
+	if (*p != ',') {
+	    break;
+	}
+	p++;
+    }
+    if (*p != 0 || n == 0) {
+	return 0;
+    }
+    fan[f].points = n;
+    return 1;
+}
+
+/* the curve's duty for a temperature, straight lines between points */
+static int curveDuty(const Fan *p, int temp)
+{
+    const CurvePoint *c = p->curve;
+    int i;
+
+    if (temp <= c[0].temp) {
+	return c[0].duty;
+    }
+    for (i = 1; i < p->points; i++) {
+	if (temp <= c[i].temp) {
+	    return c[i - 1].duty + (c[i].duty - c[i - 1].duty) *
+		(temp - c[i - 1].temp) / (c[i].temp - c[i - 1].temp);
+	}
+    }
+    return c[p->points - 1].duty;
+}
+
+/* use the pwm channel if it is there and lets us take over */
+static void initPwm(FanType f)
+{
+    Fan *p = &fan[f];
+    long duty;
+
+    p->duty = -1;
+    p->integral = 0;
+    p->written = 0;
+    duty = readSys(p->pwm);
+    if (!sensorPresent(p->pwm) ||
+	(trace.mode != TRACE_REPLAY && !enablePwm(p))) {
+	return;
+    }
+    p->duty = min(max(duty, 0), PWMMAX);
+    if (p->points == 0) {
+	/* from quiet well below the old switch off point to full */
+	/* speed where the old control switched the fan on */
+	p->curve[0].temp = p->tempOff - 10;
+	p->curve[0].duty = PWMMAX / 4;
+	p->curve[1].temp = p->tempOff;
+	p->curve[1].duty = PWMMAX / 2;
+	p->curve[2].temp = max(p->tempOn, p->tempOff + 1);
+	p->curve[2].duty = PWMMAX;
+	p->points = 3;
+    }
+}
+
+/* only the server takes the pwm channels over, the other commands */
+/* switch the fans through the port and leave the chip alone */
+static void initFanControl(int pwm)
+{
+    FanType f;
+
+    fanPortOk = backend->initFans();
+    fanPortKnown = 0;
+    fan[CPUFAN].name = "CPU";
+    fan[CPUFAN].mode = FANON;
+    fan[CPUFAN].readtemp = CPUTEMPINP;
+    fan[CPUFAN].temp = readSysTemp(fan[CPUFAN].readtemp);
+    fan[CPUFAN].tempOn = readSysTemp(CPUTEMPMAX);
+    if (fan[CPUFAN].tempOn <= 0) {
+	/* many chips found by label have no limit register */
+	fan[CPUFAN].tempOn = CPUTEMPDEFAULT;
+    }
+    fan[CPUFAN].tempOff = fan[CPUFAN].tempOn - CPUTEMPHYST;
+
+    fan[SYSFAN].name = "SYS";
+    fan[SYSFAN].mode = FANON;
+    fan[SYSFAN].readtemp = SYSTEMPINP;
+    fan[SYSFAN].temp = readSysTemp(fan[SYSFAN].readtemp);
+    fan[SYSFAN].tempOn = readSysTemp(SYSTEMPMAX);
+    if (fan[SYSFAN].tempOn <= 0) {
+	fan[SYSFAN].tempOn = SYSTEMPDEFAULT;
+    }
+    fan[SYSFAN].tempOff = fan[SYSFAN].tempOn - SYSTEMPHYST;
+
+    fan[CPUFAN].pwm = CPUFANPWM;
+    fan[SYSFAN].pwm = SYSFANPWM;
+    fanControl = fanPortOk ? CONTROLLED : UNAVAILABLE;
+    for (f = CPUFAN; f < LASTFAN; f++) {
+	fan[f].enable = -1;
+	fan[f].duty = -1;
+	if (pwm) {
+	    initPwm(f);
+	}
+	if (fan[f].duty >= 0) {
+	    fanControl = CONTROLLED;
+	}
+    }
+    if (pwm) {
+	/* an exit() on the way must not leave the fans to us */
+	atexit(releasePwm);
+    }
+#if DEB
+    if (fanControl == UNAVAILABLE) {
+	fprintf(stderr, "Fan control unavailable\n");
+    } else {
+	for (f = CPUFAN; f < LASTFAN; f++) {
+	    fprintf(stderr, "%s temp %d, fan on at %d, fan off at %d, %s\n",
+		    fan[f].name, fan[f].temp, fan[f].tempOn, fan[f].tempOff,
+		    fan[f].duty >= 0 ? "pwm" : "on/off");
+	}
+    }
+#endif
+}    
+
+/* write a duty cycle, unless it changes too little or too soon */
+static void setDuty(FanType f, int duty, int force)
+{
+    Fan *p = &fan[f];
+    long long now = monotonicMs();
+    int change = abs(duty - p->duty);
+
+    if (!force && (change < PWMSTEP ||
+		   (now - p->written < PWMGAP * 1000LL && change < PWMJUMP &&
+		    duty != PWMMAX))) {
+	return;
+    }
+    if (!writeAttr(sensors[p->pwm].path, duty)) {
+	return;
+    }
+    counters.fanWrites++;
+    p->duty = duty;
+    p->written = now;
+    p->mode = duty > 0 ? FANON : FANOFF;
+#if DEB
+    fprintf(stderr, "%s fan at %d/%d\n", p->name, duty, PWMMAX);
+#endif
+}
+
+static void toggleFan(FanType fant, FanMode mode)
+{
+    unsigned long port;
+
+    if (fan[fant].duty >= 0) {
+	setDuty(fant, mode == FANON ? PWMMAX : 0, 1);
+	return;
+    }
+    if (!fanPortOk) {
+	return;
+    }
+    if (!fanPortKnown) {
+	fanPort = backend->readFans();
+	fanPortKnown = 1;
+    }
+    port = mode ? fanPort & ~(1<<(12+fant)) : fanPort | (1<<(12+fant));
+    if (port != fanPort) {
+	backend->writeFans(port);
+	fanPort = port;
+	counters.fanWrites++;
+    }
+    fan[fant].mode = mode;
+#if DEB
+    fprintf(stderr, "Turning %s fan %s\n", 
+	    fan[fant].name, mode == FANON? "on": "off");
+#endif
+}
+
+/* PI control around the old switch off temperature, on top of the */
+/* curve; too hot is full speed whatever the controller thinks */
+static void controlPwm(FanType f)
+{
+    Fan *p = &fan[f];
+    int err = p->temp - p->tempOff;
+    double duty = curveDuty(p, p->temp) + PIKP * err + PIKI * p->integral;
+
+    if ((duty < PWMMAX || err < 0) && (duty > 0 || err > 0)) {
+	/* no wind up while the output is at a limit */
+	p->integral += err * FANINTERVAL;
+	p->integral = min(max(p->integral, -PWMMAX / PIKI), PWMMAX / PIKI);
+    }
+    if (p->temp > p->tempOn) {
+	duty = PWMMAX;
+    }
+    setDuty(f, min(max((int) duty, 0), PWMMAX), 0);
+}
+
+static void controlFans(void)
+{
+    FanType f;
+
+    if (fanControl == CONTROLLED) {
+	for (f = CPUFAN; f < LASTFAN; f++) {
+	    fan[f].temp = readSysTemp(fan[f].readtemp);
+	    if (!sensorPresent(fan[f].readtemp)) {
+		/* 0 is no reading, not a cold machine: run at full */
+		/* speed until the sensor is back */
+		toggleFan(f, FANON);
+	    } else if (fan[f].duty >= 0) {
+		controlPwm(f);
+	    } else if (fan[f].mode == FANON) {
+		/* the fan is on */
+		if (fan[f].temp <= fan[f].tempOff) {
+		    /* it's cool again */
+		    toggleFan(f, FANOFF);
+		}
+	    } else {
+		/* it's getting too warm */
+		if (fan[f].temp > fan[f].tempOn) {
+		    /* temperature went up */
+		    toggleFan(f, FANON);
+		}
+	    }
+	}
+    }
+}
+
+static void switchFans(FanMode mode)
+{
+    FanType f;
+
+    if (fanControl != UNAVAILABLE) {
+	for (f = CPUFAN; f < LASTFAN; f++) {
+	    toggleFan(f, mode);
+	}
+    }
+}
+
+static void finishFanControl(FanMode mode)
+{
+    /* always turn on both fans */
+    switchFans(mode);
+    releasePwm();
+}
+
+static void signalHandler(int sig)
+{
+    /* the server loop stops and says goodbye on the LCD itself, */
+    /* writing from here could cut into a frame still being sent */
+    terminating = 1;
+    termSignal = sig;
+}
+
+/* output to the LCD goes through a bounded queue, written whenever */
+/* the non-blocking tty accepts more, so a stalled UART can't stall us */
+
+#define OUTQUEUE 256
+#define DRAINWAIT 2000		/* milliseconds to get the last words out */
+
+static char outq[OUTQUEUE];
+static int outHead, outTail;	/* outq[outHead..outTail) is still to be sent */
+static int outFrame = -1;	/* start of a frame not yet begun, -1 if none */
+static long long outSince;	/* when the queue was last empty, us */
+static long long buttonAt;	/* a button answer is in the queue since, us */
+
+static void modifyWatch(int fd, unsigned int events);
+
+static void flushLcd(int fd)
+{
+    int res;
+
+    while (outHead < outTail) {
+	res = write(fd, outq + outHead, outTail - outHead);
+	if (res <= 0) {
+	    break;
+	} 
+	traceRecord(TRACE_OUT, outq + outHead, res);
+	outHead += res;
+	counters.serialBytes += res;
+    }
+    if (outHead == outTail) {
+	if (outSince != 0) {
+	    recordLatency(&probes[PROBE_DRAIN], nowUs() - outSince);
+	    outSince = 0;
+	}
+	if (buttonAt != 0) {
+	    recordLatency(&probes[PROBE_BUTTON], nowUs() - buttonAt);
+	    buttonAt = 0;
+	}
+	outHead = outTail = 0;
+	outFrame = -1;
+    }
+    /* ask the event loop to tell us when there is room again */
+    modifyWatch(fd, EPOLLIN | (outHead < outTail ? EPOLLOUT : 0));
+}
+
+/* queue bytes for the LCD, a frame replaces a frame that is still waiting */
+static int queueLcd(int fd, const char *buf, int len, int frame)
+{
+    if (frame && outFrame >= outHead) {
+	/* nobody will miss the superseded frame */
+	outTail = outFrame;
+    }
+    if (outTail + len > OUTQUEUE) {
+	memmove(outq, outq + outHead, outTail - outHead);
+	outTail -= outHead;
+	outFrame = outFrame >= outHead ? outFrame - outHead : -1;
+	outHead = 0;
+    }
+    if (outTail + len > OUTQUEUE) {
+	/* the panel does not keep up, let the caller know */
+	return -1;
+    }
+    if (outHead == outTail) {
+	outSince = nowUs();
+    }
+    outFrame = frame ? outTail : -1;
+    memcpy(outq + outTail, buf, len);
+    outTail += len;
+    flushLcd(fd);
+    return 0;
+}
+
+/* wait, but not forever, until the queue and the UART are empty */
+static void drainLcd(int fd, int ms)
+{
+    long long deadline = monotonicMs() + ms;
+    struct pollfd pfd;
+    int pending;
+
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    while (outHead < outTail && monotonicMs() < deadline) {
+	poll(&pfd, 1, max(deadline - monotonicMs(), 0));
+	flushLcd(fd);
+    }
+    /* tcdrain() could block for good on a stuck line, and only */
+    /* a tty has a UART to wait for */
+    while (isatty(fd) && ioctl(fd, TIOCOUTQ, &pending) == 0 && pending > 0 &&
+	   monotonicMs() < deadline) {
+	usleep(10000);
+    }
+}
+
+/* a copy of what the panel shows, so unchanged frames are not sent again */
+static char shadow[2][LINELEN + 1];
+static int shadowValid, shadowLight = -1;
+
+static void centerLine(char *row, const char *line)
+{
+    int n;
+
+    memset(row, ' ', LINELEN);
+    row[LINELEN] = 0;
+    if (line != NULL) {
+	n = min(strlen(line), LINELEN);
+	memcpy(row + (LINELEN - n) / 2, line, n);
+    }
+}
+
+#ifdef CURSORDSP
+/* send only the changed part of each row */
+static int updateLcd(char frame[2][LINELEN + 1], char *display)
+{
+    int row, first, last, len = 0;
+
+    for (row = 0; row < 2; row++) {
+	for (first = 0; first < LINELEN && frame[row][first] == shadow[row][first]; first++)
+	    ;
+	for (last = LINELEN - 1; last >= first && frame[row][last] == shadow[row][last]; last--)
+	    ;
+	if (first <= last) {
+	    len += sprintf(display + len, CURSORDSP, row, first);
+	    memcpy(display + len, frame[row] + first, last - first + 1);
+	    len += last - first + 1;
+	}
+    }
+    return len;
+}
+#endif
+
+static void lightLcd(int fd, int light)
+{
+    if (light != shadowLight) {
+	if (light) {
+	    queueLcd(fd, lightDsp, strlen(lightDsp), 0);
+	} else {
+	    queueLcd(fd, darkDsp, strlen(darkDsp), 0);
+	}
+	shadowLight = light;
+    }
+}
+
+static void drawLcd(int fd, char *line1, char *line2)
+{
+    int i;
+    char display [60];
+    char frame[2][LINELEN + 1];
+
+#if DEB
+    fprintf(stderr, "%s %s\n", line1, line2);
+#endif
+    centerLine(frame[0], line1);
+    centerLine(frame[1], line2);
+    if (shadowValid && memcmp(frame, shadow, sizeof(frame)) == 0) {
+	/* the panel already shows this */
+	return;
+    }
+#ifdef CURSORDSP
+    if (shadowValid && outFrame < outHead) {
+	/* a partial update must not replace a waiting frame */
+	shadowValid = queueLcd(fd, display, updateLcd(frame, display), 0) == 0;
+	memcpy(shadow, frame, sizeof(shadow));
+	return;
+    }
+#endif
+    memcpy(shadow, frame, sizeof(shadow));
+    shadowValid = 1;
+
+    /* clear display */
+    strcpy(display, clearDsp);
+
+    /* write both lines centered */
+    if (line1 != NULL) {
+	int l = (LINELEN - min(strlen(line1), LINELEN)) / 2;
+	for (i=0; i < l; i++) {
+	    strcat(display, " ");
+	}
+	strncat(display, line1, LINELEN);
+    }
+    strcat(display, "\n");
+    if (line2 != NULL) {
+	int l = (LINELEN - min(strlen(line2), LINELEN)) / 2;
+	for (i=0;  i < l; i++) {
+	    strcat(display, " ");
+	}
+	strncat(display, line2, LINELEN);
+    }
+    if (queueLcd(fd, display, strlen(display), 1) < 0) {
+	shadowValid = 0;
+    }
+}
+
+static void writeLcd(int fd, char *line1, char *line2)
+{
+    long long start = nowUs();
+
+    drawLcd(fd, line1, line2);
+    recordLatency(&probes[PROBE_DRAW], nowUs() - start);
+}
+
+static int waitFor(int fd, int waitSecs)
+{
+    int rc;
+    struct timeval timeout;
+    fd_set readfds;
+
+    FD_ZERO(&readfds);
+    FD_SET(fd, &readfds);
+    if (waitSecs >= 0) {
+        /* wait for specified number of seconds */
+	timeout.tv_sec = waitSecs;
+	timeout.tv_usec = 0;
+	rc = select(fd+1, &readfds, NULL, NULL, &timeout);
+    } else {
+	/* wait forever */
+	rc = select(fd+1, &readfds, NULL, NULL, NULL);
+    }
+    if (rc < 0) {
+    	rc = 0;
+    }
+    return rc;
+}
+
+static Button readButton(int fd, int wait) 
+{
+    int i, res;
+    char buf[20];
+
+    while (1) {		
+	/* wait for input */
+	if (waitFor(fd, wait)) {
+	    res = read(fd, buf, sizeof(buf));
+	    for (i = 0; i < res; i++) {
+		/* skip line noise */
+		if (buf[i] == POWERBUTTON || buf[i] == SELECTBUTTON) {
+		    return buf[i];
+		}
+	    }
+	} else {
+	    return TIMEOUT;
+	}
+    }
+}
+
+/* break an address that is too long for one line after a colon */
+static void splitAddress(const char *addr, char *line1, char *line2)
+{
+    int i, cut = min(strlen(addr), LINELEN);
+
+    for (i = cut; i > 0 && strlen(addr) > LINELEN; i--) {
+	if (addr[i-1] == ':') {
+	    cut = i;
+	    break;
+	}
+    }
+    strncpy(line1, addr, cut);
+    line1[cut] = 0;
+    strncpy(line2, addr + cut, LINELEN);
+    line2[LINELEN] = 0;
+}
+
+/* the event loop: file descriptors to watch and deadlines to meet */
+
+#define MAXWATCH 32
+#define MAXEVENTS 8
+
+typedef void (*WatchFunc)(int fd, unsigned int events);
+typedef void (*TimerFunc)(void);
+
+typedef struct {
+    int fd;
+    WatchFunc func;
+} Watch;
+
+typedef enum {
+    TIMER_FANS = 0,	/* thermal check, runs on a fixed cadence */
+    TIMER_DISPLAY,	/* refresh of the page currently shown */
+    TIMER_EXTADDR,	/* timeout of the external address lookup */
+    TIMER_JOB,		/* progress and timeout of a running job */
+    TIMER_HISTORY,	/* one sample a second for history and snapshot */
+    TIMER_METRICS,	/* the next metrics file */
+    LASTTIMER
+} TimerId;
+
+typedef struct {
+    long long due;	/* CLOCK_MONOTONIC milliseconds, 0 if not armed */
+    TimerFunc func;
+} Timer;
+
+static Watch watches[MAXWATCH];
+static Timer timers[LASTTIMER];
+static int epollfd = -1;
+
+static long long monotonicMs(void)
+{
+    return clockUs(CLOCK_MONOTONIC) / 1000;
+}
+
+static long long nowUs(void)
+{
+    return clockUs(CLOCK_MONOTONIC);
+}
+
+static void initTimer(TimerId id, TimerFunc func)
+{
+    timers[id].func = func;
+    timers[id].due = 0;
+}
+
+/* arm a timer to fire in ms milliseconds, a negative value disarms it */
+static void setTimer(TimerId id, long long ms)
+{
+    timers[id].due = ms < 0 ? 0 : monotonicMs() + ms;
+}
+
+/* milliseconds until the next deadline, -1 if there is none */
+static int nextTimeout(void)
+{
+    TimerId id;
+    long long now = monotonicMs(), next = -1;
+
+    for (id = 0; id < LASTTIMER; id++) {
+	if (timers[id].due != 0) {
+	    long long left = max(timers[id].due - now, 0);
+	    if (next < 0 || left < next) {
+		next = left;
+	    }
+	}
+    }
+    return next;
+}
+
+static void runTimers(void)
+{
+    TimerId id;
+    long long now = monotonicMs();
+
+    for (id = 0; id < LASTTIMER; id++) {
+	if (timers[id].due != 0 && timers[id].due <= now) {
+	    recordLatency(&probes[PROBE_WAKEUP], nowUs() - timers[id].due * 1000);
+	    timers[id].due = 0;
+	    timers[id].func();
+	}
+    }
+}
+
+static int watchFd(int fd, unsigned int events, WatchFunc func)
+{
+    int i;
+    struct epoll_event ev;
+
+    for (i = 0; i < MAXWATCH; i++) {
+	if (watches[i].func == NULL) {
+	    watches[i].fd = fd;
+	    watches[i].func = func;
+	    ev.events = events;
+	    ev.data.ptr = &watches[i];
+	    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		perror("epoll_ctl()");
+		watches[i].func = NULL;
+		return -1;
+	    }
+	    return 0;
+	}
+    }
+    return -1;
+}
+
+static void modifyWatch(int fd, unsigned int events)
+{
+    int i;
+    struct epoll_event ev;
+
+    for (i = 0; i < MAXWATCH && epollfd >= 0; i++) {
+	if (watches[i].func != NULL && watches[i].fd == fd) {
+	    ev.events = events;
+	    ev.data.ptr = &watches[i];
+	    epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &ev);
+	}
+    }
+}
+
+static void unwatchFd(int fd)
+{
+    int i;
+
+    for (i = 0; i < MAXWATCH; i++) {
+	if (watches[i].func != NULL && watches[i].fd == fd) {
+	    epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, NULL);
+	    watches[i].func = NULL;
+	}
+    }
+}
+
+static int replayWait(int timeout);
+
+/* wait at most timeout ms for events, handle them and due timers */
+static void runOnce(int timeout)
+{
+    struct epoll_event events[MAXEVENTS];
+    int i, n;
+
+    if (trace.mode == TRACE_REPLAY) {
+	/* the trace moves the clock, we never wait */
+	timeout = replayWait(timeout);
+    }
+    n = epoll_wait(epollfd, events, MAXEVENTS, timeout);
+    counters.loops++;
+    for (i = 0; i < n && !terminating; i++) {
+	Watch *w = events[i].data.ptr;
+	if (w->func != NULL) {
+	    w->func(w->fd, events[i].events);
+	}
+    }
+    runTimers();
+}
+
+static void dumpLatency(void);
+
+static void runLoop(void)
+{
+    while (!terminating) {
+	runOnce(nextTimeout());
+	if (probeDump) {
+	    probeDump = 0;
+	    dumpLatency();
+	}
+    }
+}
+
+typedef enum {
+    MODE_NONE = 0,
+    MODE_POWEROFF,
+    MODE_FANOFF,
+    MODE_WLANOFF,
+    MODE_FIREWALL
+} PowerButtonMode;
+
+/* if this file exists then the firewall is on, -s firewall=path overrides */
+#define FIREWALLSTATUSFILE "/var/tmp/firewall_is_on"
+#define firewall_is_on() stateOn(STATE_FIREWALL)
+
+/* server state, kept between two steps of the display state machine */
+static int serverfd, ueventfd, listenfd, inotifyfd, delay, fani, wlan;
+static long long powerDeadline; /* end of the power off prompt */
+static char message[2][LINELEN + 1];	/* the MESSAGE page */
+static PowerButtonMode powerButtonMode;
+static Darkness darkness;
+static Display display;
+
+static void serverStep(Button button);
+
+/* redraw a page with new data if it is currently shown */
+static void refreshPage(Display page)
+{
+    if (page == display && darkness != DARK && !terminating) {
+	serverStep(REFRESH);
+    }
+}
+
+/* state files: a state is on while its file exists. The server */
+/* watches their directories with inotify and keeps the answer, */
+/* so a change made by someone else shows up at once. There is */
+/* one file per state and firewall is the only state for now; a */
+/* new one needs its StateId, a table entry and a page to redraw. */
+
+typedef enum {
+    STATE_FIREWALL = 0,
+    LASTSTATE
+} StateId;
+
+typedef struct {
+    const char *name;	/* for -s name=path */
+    const char *path;
+    Display page;	/* page to redraw when the state changes */
+    int on;		/* the file exists */
+    int wd;		/* inotify watch of the directory, -1 if none */
+} StateFile;
+
+static StateFile stateFiles[LASTSTATE] = {
+    /* the path is set by -s or by main() from the backend */
+    {"firewall", NULL, FIREWALLCTL, 0, -1},
+};
+
+static int stateOn(StateId id)
+{
+    StateFile *f = &stateFiles[id];
+
+    /* without a watch we have to look */
+    return f->wd >= 0 ? f->on : access(f->path, F_OK) == 0;
+}
+
+/* set the path of a state file from name=path */
+static int setStateFile(const char *arg)
+{
+    StateId id;
+    size_t n = strcspn(arg, "=");
+
+    for (id = 0; id < LASTSTATE; id++) {
+	if (arg[n] == '=' && arg[n + 1] != 0 &&
+	    strncmp(stateFiles[id].name, arg, n) == 0 &&
+	    stateFiles[id].name[n] == 0) {
+	    stateFiles[id].path = arg + n + 1;
+	    return 1;
+	}
+    }
+    return 0;
+}
+
+static void updateState(StateFile *f)
+{
+    int on = access(f->path, F_OK) == 0;
+
+    if (on != f->on) {
+	f->on = on;
+#if DEB
+	fprintf(stderr, "state %s is %s\n", f->name, on ? "on" : "off");
+#endif
+	refreshPage(f->page);
+    }
+}
+
+static void onInotify(int fd, unsigned int events)
+{
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    const char *base;
+    StateId id;
+    int len, i;
+
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+	for (i = 0; i < len; i += sizeof(*ev) + ev->len) {
+	    ev = (struct inotify_event *) (buf + i);
+	    for (id = 0; id < LASTSTATE; id++) {
+		base = strrchr(stateFiles[id].path, '/');
+		base = base != NULL ? base + 1 : stateFiles[id].path;
+		/* after an overflow we don't know, so look at all */
+		if ((ev->mask & IN_Q_OVERFLOW) ||
+		    (ev->wd == stateFiles[id].wd && ev->len > 0 &&
+		     strcmp(ev->name, base) == 0)) {
+		    updateState(&stateFiles[id]);
+		}
+	    }
+	}
+    }
+}
+
+static int initStates(void)
+{
+    char dir[255];
+    const char *slash;
+    StateId id;
+    int fd;
+
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+	perror("inotify_init1()");
+	return -1;
+    }
+    for (id = 0; id < LASTSTATE; id++) {
+	StateFile *f = &stateFiles[id];
+
+	slash = strrchr(f->path, '/');
+	if (slash == NULL) {
+	    strcpy(dir, ".");
+	} else {
+	    snprintf(dir, sizeof(dir), "%.*s",
+		     (int) (slash == f->path ? 1 : slash - f->path), f->path);
+	}
+	/* the file comes and goes, so its directory is watched */
+	f->wd = inotify_add_watch(fd, dir, IN_CREATE | IN_DELETE |
+				  IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR);
+	if (f->wd < 0) {
+	    perror(dir);
+	}
+	f->on = access(f->path, F_OK) == 0;
+    }
+    watchFd(fd, EPOLLIN, onInotify);
+    return fd;
+}
+
+/* disk temperatures, read without smartctl */
+
+#define SMARTTEMP 194		/* SMART attribute: temperature */
+#define SMARTAIRFLOWTEMP 190	/* SMART attribute: airflow temperature */
+
+/* the kernel drivetemp driver, if loaded, offers a hwmon sensor per disk */
+static int driveTemp(const char *dev)
+{
+    char pathname[255], buf[32];
+    DIR *dir;
+    struct dirent *de;
+    int fd, res = 0;
+
+    snprintf(pathname, sizeof(pathname), "/sys/block/%.32s/device/hwmon", dev);
+    dir = opendir(pathname);
+    if (dir == NULL) {
+	return -1;
+    }
+    while ((de = readdir(dir)) != NULL) {
+	if (strncmp(de->d_name, "hwmon", 5) == 0) {
+	    snprintf(pathname, sizeof(pathname),
+		     "/sys/block/%s/device/hwmon/%.32s/temp1_input", dev, de->d_name);
+	    break;
+	}
+    }
+    closedir(dir);
+    if (de == NULL || (fd = open(pathname, O_RDONLY)) < 0) {
+	return -1;
+    }
+    res = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (res <= 0) {
+	return -1;
+    }
+    buf[res] = 0;
+    /* temperatures are stored in 1/1000 degrees */
+    return (atoi(buf) + 500) / 1000;
+}
+
+/* issue ATA SMART READ DATA through SG_IO and look up the temperature */
+static int smartTemp(const char *dev)
+{
+    unsigned char cdb[16], data[512], sense[32];
+    char pathname[64];
+    sg_io_hdr_t io;
+    int i, fd, temp = -1;
+
+    snprintf(pathname, sizeof(pathname), "/dev/%s", dev);
+    fd = open(pathname, O_RDONLY | O_NONBLOCK);
+    if (fd < 0) {
+	return -1;
+    }
+    memset(cdb, 0, sizeof(cdb));
+    cdb[0] = 0x85;		/* ATA PASS-THROUGH (16) */
+    cdb[1] = 4 << 1;		/* PIO data-in */
+    cdb[2] = 0x0e;		/* from device, length in sector count, blocks */
+    cdb[4] = 0xd0;		/* feature: SMART READ DATA */
+    cdb[6] = 1;			/* one sector */
+    cdb[10] = 0x4f;		/* SMART signature in LBA mid/high */
+    cdb[12] = 0xc2;
+    cdb[14] = 0xb0;		/* command: SMART */
+
+    memset(&io, 0, sizeof(io));
+    io.interface_id = 'S';
+    io.cmdp = cdb;
+    io.cmd_len = sizeof(cdb);
+    io.dxferp = data;
+    io.dxfer_len = sizeof(data);
+    io.dxfer_direction = SG_DXFER_FROM_DEV;
+    io.sbp = sense;
+    io.mx_sb_len = sizeof(sense);
+    io.timeout = 5000;		/* milliseconds */
+
+    if (ioctl(fd, SG_IO, &io) == 0 &&
+	(io.info & SG_INFO_OK_MASK) == SG_INFO_OK) {
+	/* 30 attributes of 12 bytes: id, flags(2), value, worst, raw(6), reserved */
+	for (i = 2; i + 12 <= 2 + 30 * 12; i += 12) {
+	    if (data[i] == SMARTTEMP ||
+		(data[i] == SMARTAIRFLOWTEMP && temp < 0)) {
+		/* the lowest raw byte is the current temperature */
+		temp = data[i + 5];
+	    }
+	}
+    }
+    close(fd);
+    return temp;
+}
+
+static int diskTemp(const char *dev)
+{
+    int temp = driveTemp(dev);
+
+    return temp >= 0 ? temp : smartTemp(dev);
+}
+
+/* runs in a collector child, the output is read back by the server */
+static void diskProbe(const char *dev)
+{
+    int temp = diskTemp(dev);
+
+    if (temp >= 0) {
+	printf("%d", temp);
+    }
+}
+
+/* runs in a collector child, getaddrinfo() may block for a long time */
+static void resolveProbe(const char *host)
+{
+    struct addrinfo hints, *ai;
+    char buf[INET6_ADDRSTRLEN];
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, NULL, &hints, &ai) == 0) {
+	if (getnameinfo(ai->ai_addr, ai->ai_addrlen, buf, sizeof(buf),
+			NULL, 0, NI_NUMERICHOST) == 0) {
+	    printf("%s", buf);
+	}
+	freeaddrinfo(ai);
+    }
+}
+
+/* background data collectors: slow probes are functions of ours run */
+/* in child processes, and their output is read from a non-blocking */
+/* pipe by the event loop */
+
+#define MAXDISKS 16
+
+typedef enum {
+    COLLECT_RESOLVE = 0,	/* host name of an external address endpoint */
+    COLLECT_DISKS,		/* one collector per disk from here on */
+    LASTCOLLECTOR = COLLECT_DISKS + MAXDISKS
+} CollectorId;
+
+typedef struct {
+    void (*probe)(const char *arg);	/* function to call in the child */
+    const char *arg;
+    Display page;	/* page to refresh when new output arrives */
+    int maxAge;		/* seconds a successful result is kept */
+    int retryAge;	/* seconds an empty result is kept */
+    pid_t pid;		/* running child, 0 if idle, -1 if replayed */
+    long long started;	/* when it was started, microseconds */
+    int fd;		/* read end of the child's stdout */
+    int ready;		/* result holds a complete run */
+    long long stamp;	/* when the result was completed */
+    int fill;		/* bytes of output read so far */
+    char buf[64];
+    int len;
+    char result[64];
+    Histogram latency;	/* start to end of its runs */
+} Collector;
+
+static Collector collectors[LASTCOLLECTOR] = {
+    {resolveProbe, NULL, EXTADDR, 0, 0},
+};
+
+static Collector *collectorByFd(int fd)
+{
+    CollectorId id;
+
+    for (id = 0; id < LASTCOLLECTOR; id++) {
+	if (collectors[id].pid != 0 && collectors[id].fd == fd) {
+	    return &collectors[id];
+	}
+    }
+    return NULL;
+}
+
+/* seconds the current result of a collector stays valid */
+static int collectorAge(Collector *c)
+{
+    return c->ready && c->len > 0 ? c->maxAge : c->retryAge;
+}
+
+static int isStale(Collector *c)
+{
+    return !c->ready || monotonicMs() - c->stamp >= collectorAge(c) * 1000LL;
+}
+
+static void collectDisks(void);
+static void onResolved(Collector *c);
+
+/* children that closed their pipe but had not exited yet */
+static pid_t unreaped[2 * LASTCOLLECTOR];
+
+static void reapCollectors(void)
+{
+    int i;
+
+    for (i = 0; i < 2 * LASTCOLLECTOR; i++) {
+	if (unreaped[i] != 0 && waitpid(unreaped[i], NULL, WNOHANG) != 0) {
+	    unreaped[i] = 0;
+	}
+    }
+}
+
+/* reap a child without waiting for it, or remember it for later */
+static void reapCollector(pid_t pid)
+{
+    int i;
+
+    reapCollectors();
+    if (waitpid(pid, NULL, WNOHANG) != 0) {
+	return;
+    }
+    for (i = 0; i < 2 * LASTCOLLECTOR && unreaped[i] != 0; i++)
+	;
+    if (i < 2 * LASTCOLLECTOR) {
+	unreaped[i] = pid;
+    } else {
+	/* too many stuck on their way out, this one is nearly gone */
+	waitpid(pid, NULL, 0);
+    }
+}
+
+static void finishCollector(Collector *c)
+{
+    unwatchFd(c->fd);
+    close(c->fd);
+    if (c->pid > 0) {
+	reapCollector(c->pid);
+    }
+    c->pid = 0;
+    c->ready = 1;
+    c->stamp = monotonicMs();
+    counters.collections++;
+    counters.collectUs += nowUs() - c->started;
+    recordLatency(&c->latency, nowUs() - c->started);
+    memcpy(c->result, c->buf, c->fill);
+    c->len = c->fill;
+    c->result[c->len] = 0;
+    if (trace.mode == TRACE_RECORD) {
+	char rec[sizeof(c->result) + 1];
+	rec[0] = c - collectors;
+	memcpy(rec + 1, c->result, c->len);
+	traceRecord(TRACE_COLLECT, rec, c->len + 1);
+    }
+#if DEB
+    fprintf(stderr, "collected \"%s\": %s\n", c->arg, c->result);
+#endif
+    if (c->probe == diskProbe) {
+	/* keep the worker pool busy until all disks are up to date */
+	collectDisks();
+    } else if (c->probe == resolveProbe) {
+	onResolved(c);
+    }
+    refreshPage(c->page);
+}
+
+static void onCollector(int fd, unsigned int events)
+{
+    Collector *c = collectorByFd(fd);
+    char buf[64];
+    int res;
+
+    if (c == NULL) {
+	return;
+    }
+    /* keep what fits, but drain the pipe, up to its end if */
+    /* the child is done */
+    while ((res = read(fd, buf, sizeof(buf))) > 0) {
+	res = min(res, (int) sizeof(c->buf) - 1 - c->fill);
+	memcpy(c->buf + c->fill, buf, res);
+	c->fill += res;
+    }
+    if (res == 0 || errno != EAGAIN) {
+	/* end of output */
+	finishCollector(c);
+    }
+}
+
+static int replayCollector(Collector *c, int fd);
+
+static void startCollector(Collector *c)
+{
+    int pipefd[2];
+
+    reapCollectors();
+    if (pipe2(pipefd, O_CLOEXEC) < 0) {
+	perror("pipe2()");
+	return;
+    }
+    c->started = nowUs();
+    if (trace.mode == TRACE_REPLAY) {
+	/* nothing is run: the recorded output comes from us when */
+	/* its record is due, and the pid only marks it busy */
+	if (!replayCollector(c, pipefd[1])) {
+	    close(pipefd[1]);
+	}
+	c->pid = -1;
+	fcntl(pipefd[0], F_SETFL, O_NONBLOCK);
+	c->fd = pipefd[0];
+	c->fill = 0;
+	watchFd(c->fd, EPOLLIN, onCollector);
+	return;
+    }
+    c->pid = fork();
+    counters.forks++;
+    if (c->pid == 0) {
+	/* child: run the probe in its own process group; the parent */
+	/* sets it too, so kill(-pid) never comes too early */
+	setpgid(0, 0);
+	/* there is no exec to drop the server's handlers, and */
+	/* with them SIGTERM would only set our terminating flag */
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGHUP, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGQUIT, SIG_DFL);
+	signal(SIGSEGV, SIG_DFL);
+	signal(SIGBUS, SIG_DFL);
+	signal(SIGUSR1, SIG_DFL);
+	dup2(pipefd[1], STDOUT_FILENO);
+	c->probe(c->arg);
+	fflush(stdout);
+	_exit(0);
+    }
+    if (c->pid > 0) {
+	setpgid(c->pid, c->pid);
+    }
+    close(pipefd[1]);
+    if (c->pid < 0) {
+	perror("fork()");
+	c->pid = 0;
+	close(pipefd[0]);
+	return;
+    }
+    fcntl(pipefd[0], F_SETFL, O_NONBLOCK);
+    c->fd = pipefd[0];
+    c->fill = 0;
+    watchFd(c->fd, EPOLLIN, onCollector);
+}
+
+/* the disks found in /sys/block, an empty name marks a free slot */
+static char diskNames[MAXDISKS][32];
+
+/* start workers for out of date disks, at most MAXDISKWORKERS at once */
+static void collectDisks(void)
+{
+    int i, running = 0;
+    Collector *c;
+
+    for (i = 0; i < MAXDISKS; i++) {
+	running += collectors[COLLECT_DISKS + i].pid != 0;
+    }
+    for (i = 0; i < MAXDISKS && running < MAXDISKWORKERS && !terminating; i++) {
+	c = &collectors[COLLECT_DISKS + i];
+	if (diskNames[i][0] != 0 && c->pid == 0 && isStale(c)) {
+	    startCollector(c);
+	    running += c->pid != 0;
+	}
+    }
+}
+
+static int isDisk(const struct dirent *de)
+{
+    char pathname[64];
+
+    /* only real drives have a device, loop, ram and md devices don't */
+    snprintf(pathname, sizeof(pathname), "/sys/block/%.32s/device", de->d_name);
+    return de->d_name[0] != '.' && access(pathname, F_OK) == 0;
+}
+
+static int findDisk(const char *name)
+{
+    int i;
+
+    for (i = 0; i < MAXDISKS; i++) {
+	if (strcmp(diskNames[i], name) == 0) {
+	    return i;
+	}
+    }
+    return -1;
+}
+
+static void initDisk(int i, const char *name)
+{
+    Collector *c = &collectors[COLLECT_DISKS + i];
+
+    snprintf(diskNames[i], sizeof(diskNames[i]), "%.31s", name);
+    memset(c, 0, sizeof(*c));
+    c->probe = diskProbe;
+    c->arg = diskNames[i];
+    c->page = DISKTEMPS;
+    c->maxAge = c->retryAge = diskMaxAge;
+}
+
+/* a new disk takes the first free slot */
+static void addDisk(const char *name)
+{
+    int i;
+
+    for (i = 0; i < MAXDISKS; i++) {
+	if (diskNames[i][0] == 0 && collectors[COLLECT_DISKS + i].pid == 0) {
+	    initDisk(i, name);
+	    return;
+	}
+    }
+}
+
+/* bring the disk table in line with a list of names, keeping known disks */
+static void setDisks(char *const names[], int n)
+{
+    int i, j;
+
+    for (i = 0; i < MAXDISKS; i++) {
+	/* forget disks that are gone */
+	for (j = 0; j < n && strcmp(diskNames[i], names[j]) != 0; j++)
+	    ;
+	if (j == n) {
+	    diskNames[i][0] = 0;
+	}
+    }
+    for (j = 0; j < n; j++) {
+	if (findDisk(names[j]) < 0) {
+	    addDisk(names[j]);
+	}
+    }
+}
+
+static void traceDisks(void)
+{
+    char rec[sizeof(diskNames)];
+    int i, len = 0;
+
+    for (i = 0; i < MAXDISKS; i++) {
+	strcpy(rec + len, diskNames[i]);
+	len += strlen(diskNames[i]) + 1;
+    }
+    traceRecord(TRACE_DISKS, rec, len);
+}
+
+/* bring the disk table in line with /sys/block */
+static void scanDisks(void)
+{
+    struct dirent **list;
+    char *names[MAXDISKS];
+    int j, n;
+
+    if (trace.mode == TRACE_REPLAY) {
+	/* the disks are those of the trace */
+	return;
+    }
+    n = scandir("/sys/block", &list, isDisk, alphasort);
+    if (n < 0) {
+	return;
+    }
+    for (j = 0; j < n && j < MAXDISKS; j++) {
+	names[j] = list[j]->d_name;
+    }
+    setDisks(names, j);
+    for (j = 0; j < n; j++) {
+	free(list[j]);
+    }
+    free(list);
+    traceDisks();
+}
+
+/* hotplug: rescan the disks when the kernel adds or removes one */
+static void onUevent(int fd, unsigned int events)
+{
+    char buf[4096];
+    int len, i, block, change;
+
+    while ((len = recv(fd, buf, sizeof(buf) - 1, 0)) > 0) {
+	buf[len] = 0;
+	block = change = 0;
+	/* the message is a list of NUL terminated KEY=value strings */
+	for (i = 0; i < len; i += strlen(buf + i) + 1) {
+	    block |= strcmp(buf + i, "SUBSYSTEM=block") == 0;
+	    change |= strcmp(buf + i, "ACTION=add") == 0 ||
+		strcmp(buf + i, "ACTION=remove") == 0;
+	}
+	if (block && change) {
+	    scanDisks();
+	    refreshPage(DISKTEMPS);
+	}
+    }
+}
+
+static int initUevent(void)
+{
+    struct sockaddr_nl snl;
+    int fd;
+
+    fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		NETLINK_KOBJECT_UEVENT);
+    if (fd < 0) {
+	perror("uevent socket()");
+	return -1;
+    }
+    memset(&snl, 0, sizeof(snl));
+    snl.nl_family = AF_NETLINK;
+    snl.nl_groups = 1;		/* kernel events */
+    if (bind(fd, (struct sockaddr *) &snl, sizeof(snl)) < 0) {
+	perror("uevent bind()");
+	close(fd);
+	return -1;
+    }
+    watchFd(fd, EPOLLIN, onUevent);
+    return fd;
+}
+
+/* one line of the disk page, like "sda 38" */
+static void diskLine(int i, char *buf)
+{
+    Collector *c = &collectors[COLLECT_DISKS + i];
+    int temp = atoi(c->result);
+
+    if (tempunit == FAHRENHEIT) {
+	temp = ((float)temp * 1.8) + 32;
+    }
+    if (!c->ready) {
+	sprintf(buf, "%s ...", diskNames[i]);
+    } else if (c->len > 0) {
+	sprintf(buf, "%s %d", diskNames[i], temp);
+    } else {
+	sprintf(buf, "%s ???", diskNames[i]);
+    }
+}
+
+static void stopCollectors(void)
+{
+    CollectorId id;
+
+    for (id = 0; id < LASTCOLLECTOR; id++) {
+	if (collectors[id].pid != 0) {
+	    if (collectors[id].pid > 0) {
+		kill(-collectors[id].pid, SIGTERM);
+	    }
+	    finishCollector(&collectors[id]);
+	}
+    }
+}
+
+static int extDue(void);
+static void lookupExtAddr(void);
+
+/* prefetch: while a page is shown, the collectors of the page that */
+/* SELECT brings up next are started, so their results are in the */
+/* cache when we get there. The runs come out of a budget that */
+/* refills at prefetchBudget per hour. */
+
+static long long prefetchStamp; /* the budget is empty at this time */
+
+static int spendPrefetch(void)
+{
+    long long now = monotonicMs(), cost;
+
+    if (prefetchBudget <= 0) {
+	return 0;
+    }
+    cost = 3600000LL / prefetchBudget;
+    /* unused runs add up to at most one hour's worth */
+    if (prefetchStamp < now - 3600000LL) {
+	prefetchStamp = now - 3600000LL;
+    }
+    if (prefetchStamp + cost > now) {
+	return 0;
+    }
+    prefetchStamp += cost;
+    return 1;
+}
+
+/* the page SELECT shows after this one */
+static Display nextPage(Display page)
+{
+    page++;
+    if (page == FANCTL && fanControl == UNAVAILABLE) {
+	page++;
+    }
+    return page < LASTDISPLAY ? page : DATETIME;
+}
+
+static void prefetchPage(Display page)
+{
+    Collector *c;
+    int i;
+
+    switch (page) {
+    case DISKTEMPS:
+	for (i = 0; i < MAXDISKS; i++) {
+	    c = &collectors[COLLECT_DISKS + i];
+	    if (diskNames[i][0] != 0 && c->pid == 0 && isStale(c)) {
+		/* one run of the budget covers the whole sweep */
+		if (spendPrefetch()) {
+		    collectDisks();
+		}
+		return;
+	    }
+	}
+	break;
+    case EXTADDR:
+	if (extDue() && spendPrefetch()) {
+	    lookupExtAddr();
+	}
+	break;
+    default:
+	/* the other pages read their data when they are shown */
+	break;
+    }
+}
+
+/* the interface table, kept up to date by rtnetlink events */
+
+#define MAXIFACES 16
+#define MAXADDRS 32
+
+typedef struct {
+    int index;		/* kernel interface index, 0 if the slot is free */
+    unsigned int flags;
+    char name[IFNAMSIZ];
+} Iface;
+
+typedef struct {
+    int index;		/* interface the address belongs to, 0 if free */
+    int family;
+    int scope;
+    unsigned char addr[16];
+} IfAddr;
+
+/* the default route, to notice when our way to the internet changes */
+typedef struct {
+    int oif;
+    unsigned char gateway[16];
+} Route;
+
+static Iface ifaces[MAXIFACES];
+static IfAddr ifaddrs[MAXADDRS];
+static Route defaultRoute[2];		/* IPv4 and IPv6 */
+static unsigned int routeGeneration;	/* counts default route changes */
+static int nlfd = -1;
+static int nlDump;		/* dump request in progress, 0 if none */
+
+static Iface *findIface(int index, const char *name)
+{
+    int i;
+
+    for (i = 0; i < MAXIFACES; i++) {
+	if (ifaces[i].index != 0 &&
+	    (name == NULL ? ifaces[i].index == index :
+	     strcmp(ifaces[i].name, name) == 0)) {
+	    return &ifaces[i];
+	}
+    }
+    return NULL;
+}
+
+static int isLanIface(int index)
+{
+    Iface *ifc = findIface(index, NULL);
+
+    return ifc != NULL &&
+	(strcmp(ifc->name, lanif[0]) == 0 || strcmp(ifc->name, lanif[1]) == 0);
+}
+
+/* ask the kernel for all links or all addresses */
+static void nlRequest(int type)
+{
+    struct {
+	struct nlmsghdr nlh;
+	struct rtgenmsg gen;
+    } req;
+
+    memset(&req, 0, sizeof(req));
+    req.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(req.gen));
+    req.nlh.nlmsg_type = type;
+    req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    req.gen.rtgen_family = AF_UNSPEC;
+    if (send(nlfd, &req, req.nlh.nlmsg_len, 0) < 0) {
+	perror("netlink send()");
+	return;
+    }
+    nlDump = type;
+}
+
+/* returns 1 if the change concerns one of the LAN interfaces */
+static int handleLink(struct nlmsghdr *nlh)
+{
+    struct ifinfomsg *ifi = NLMSG_DATA(nlh);
+    int len = IFLA_PAYLOAD(nlh);
+    struct rtattr *rta;
+    Iface *ifc = findIface(ifi->ifi_index, NULL);
+    int i, lan = isLanIface(ifi->ifi_index);
+
+    if (nlh->nlmsg_type == RTM_DELLINK) {
+	if (ifc != NULL) {
+	    ifc->index = 0;
+	}
+	for (i = 0; i < MAXADDRS; i++) {
+	    if (ifaddrs[i].index == ifi->ifi_index) {
+		ifaddrs[i].index = 0;
+	    }
+	}
+	return lan;
+    }
+    for (i = 0; ifc == NULL && i < MAXIFACES; i++) {
+	if (ifaces[i].index == 0) {
+	    ifc = &ifaces[i];
+	    ifc->name[0] = 0;
+	}
+    }
+    if (ifc == NULL) {
+	return 0;
+    }
+    ifc->index = ifi->ifi_index;
+    ifc->flags = ifi->ifi_flags;
+    for (rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+	if (rta->rta_type == IFLA_IFNAME) {
+	    strncpy(ifc->name, RTA_DATA(rta), IFNAMSIZ - 1);
+	    ifc->name[IFNAMSIZ - 1] = 0;
+	}
+    }
+    return lan || isLanIface(ifi->ifi_index);
+}
+
+static int handleAddr(struct nlmsghdr *nlh)
+{
+    struct ifaddrmsg *ifa = NLMSG_DATA(nlh);
+    int len = IFA_PAYLOAD(nlh);
+    int i, alen = ifa->ifa_family == AF_INET ? 4 : 16;
+    struct rtattr *rta;
+    unsigned char *addr = NULL;
+    IfAddr *slot = NULL;
+
+    if (ifa->ifa_family != AF_INET && ifa->ifa_family != AF_INET6) {
+	return 0;
+    }
+    for (rta = IFA_RTA(ifa); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+	/* IFA_LOCAL is our side of a point to point link */
+	if (rta->rta_type == IFA_LOCAL ||
+	    (rta->rta_type == IFA_ADDRESS && addr == NULL)) {
+	    addr = RTA_DATA(rta);
+	}
+    }
+    if (addr == NULL) {
+	return 0;
+    }
+    for (i = 0; i < MAXADDRS; i++) {
+	if (ifaddrs[i].index == ifa->ifa_index &&
+	    ifaddrs[i].family == ifa->ifa_family &&
+	    memcmp(ifaddrs[i].addr, addr, alen) == 0) {
+	    slot = &ifaddrs[i];
+	} else if (ifaddrs[i].index == 0 && slot == NULL &&
+		   nlh->nlmsg_type == RTM_NEWADDR) {
+	    slot = &ifaddrs[i];
+	}
+    }
+    if (slot == NULL) {
+	return 0;
+    }
+    if (nlh->nlmsg_type == RTM_DELADDR) {
+	slot->index = 0;
+    } else {
+	slot->index = ifa->ifa_index;
+	slot->family = ifa->ifa_family;
+	slot->scope = ifa->ifa_scope;
+	memset(slot->addr, 0, sizeof(slot->addr));
+	memcpy(slot->addr, addr, alen);
+    }
+    return isLanIface(ifa->ifa_index);
+}
+
+static void handleRoute(struct nlmsghdr *nlh)
+{
+    struct rtmsg *rtm = NLMSG_DATA(nlh);
+    int len = RTM_PAYLOAD(nlh);
+    struct rtattr *rta;
+    Route route, *slot;
+
+    if (rtm->rtm_dst_len != 0 || rtm->rtm_table != RT_TABLE_MAIN ||
+	rtm->rtm_type != RTN_UNICAST ||
+	(rtm->rtm_family != AF_INET && rtm->rtm_family != AF_INET6)) {
+	return;
+    }
+    slot = &defaultRoute[rtm->rtm_family == AF_INET6];
+    memset(&route, 0, sizeof(route));
+    for (rta = RTM_RTA(rtm); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+	if (rta->rta_type == RTA_OIF) {
+	    route.oif = *(int *) RTA_DATA(rta);
+	} else if (rta->rta_type == RTA_GATEWAY) {
+	    memcpy(route.gateway, RTA_DATA(rta),
+		   min(RTA_PAYLOAD(rta), sizeof(route.gateway)));
+	}
+    }
+    if (nlh->nlmsg_type == RTM_DELROUTE) {
+	/* only the removal of the route we use counts */
+	if (memcmp(&route, slot, sizeof(route)) != 0) {
+	    return;
+	}
+	memset(&route, 0, sizeof(route));
+    }
+    if (memcmp(&route, slot, sizeof(route)) != 0) {
+	*slot = route;
+	routeGeneration++;
+    }
+}
+
+static void onNetlink(int fd, unsigned int events)
+{
+    char buf[8192];
+    struct nlmsghdr *nlh;
+    int len, changed = 0;
+
+    while ((len = recv(fd, buf, sizeof(buf), 0)) != 0) {
+	if (len < 0) {
+	    if (errno == ENOBUFS) {
+		/* we missed events, read the whole table again */
+		memset(ifaces, 0, sizeof(ifaces));
+		memset(ifaddrs, 0, sizeof(ifaddrs));
+		nlRequest(RTM_GETLINK);
+		continue;
+	    }
+	    break;
+	}
+	for (nlh = (struct nlmsghdr *) buf; NLMSG_OK(nlh, len);
+	     nlh = NLMSG_NEXT(nlh, len)) {
+	    switch (nlh->nlmsg_type) {
+	    case RTM_NEWLINK:
+	    case RTM_DELLINK:
+		changed |= handleLink(nlh);
+		break;
+	    case RTM_NEWADDR:
+	    case RTM_DELADDR:
+		changed |= handleAddr(nlh);
+		break;
+	    case RTM_NEWROUTE:
+	    case RTM_DELROUTE:
+		handleRoute(nlh);
+		break;
+	    case NLMSG_DONE:
+		/* after the links come the addresses, then the routes */
+		if (nlDump == RTM_GETLINK) {
+		    nlRequest(RTM_GETADDR);
+		} else if (nlDump == RTM_GETADDR) {
+		    nlRequest(RTM_GETROUTE);
+		} else {
+		    nlDump = 0;
+		}
+		break;
+	    }
+	}
+    }
+    if (changed) {
+	refreshPage(LANADDR);
+    }
+}
+
+static void initNetlink(void)
+{
+    struct sockaddr_nl snl;
+
+    nlfd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		  NETLINK_ROUTE);
+    if (nlfd < 0) {
+	perror("netlink socket()");
+	return;
+    }
+    memset(&snl, 0, sizeof(snl));
+    snl.nl_family = AF_NETLINK;
+    snl.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR |
+	RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_ROUTE;
+    if (bind(nlfd, (struct sockaddr *) &snl, sizeof(snl)) < 0) {
+	perror("netlink bind()");
+	close(nlfd);
+	nlfd = -1;
+	return;
+    }
+    watchFd(nlfd, EPOLLIN, onNetlink);
+    nlRequest(RTM_GETLINK);
+}
+
+/* find the address of a LAN interface, IPv4 if it has one, */
+/* otherwise its first global IPv6 address */
+static int lanAddress(const char *ifname, char *buf, size_t len)
+{
+    Iface *ifc = findIface(0, ifname);
+    int i, family;
+
+    if (ifc == NULL || !(ifc->flags & IFF_UP)) {
+	return 0;
+    }
+    for (family = AF_INET; family != 0; family = family == AF_INET ? AF_INET6 : 0) {
+	for (i = 0; i < MAXADDRS; i++) {
+	    if (ifaddrs[i].index == ifc->index &&
+		ifaddrs[i].family == family &&
+		ifaddrs[i].scope == RT_SCOPE_UNIVERSE) {
+		return inet_ntop(family, ifaddrs[i].addr, buf, len) != NULL;
+	    }
+	}
+    }
+    return 0;
+}
+
+/* the external address: a small HTTP client on a non-blocking socket */
+/* asks the endpoints in turn for the address the internet sees */
+
+#define MAXENDPOINTS 4
+
+/* the endpoints used when there is no -e, they answer in plain text */
+static const char *defaultEndpoints[] = {
+    "http://ifconfig.me/ip", "http://icanhazip.com/", NULL
+};
+
+typedef struct {
+    char host[64];
+    char port[8];
+    char path[128];
+    struct sockaddr_storage addr;	/* the host, once resolved */
+    socklen_t addrlen;			/* 0 if not resolved */
+    long long resolved;			/* when it was resolved */
+    char etag[64];			/* validators of the last answer */
+    char modified[40];
+    char result[INET6_ADDRSTRLEN];	/* address of the last answer */
+} Endpoint;
+
+typedef enum {
+    EXT_IDLE = 0,
+    EXT_RESOLVE,	/* waiting for the resolver collector */
+    EXT_CONNECT,	/* connecting and sending the request */
+    EXT_RECEIVE		/* reading the response */
+} ExtState;
+
+static Endpoint endpoints[MAXENDPOINTS];
+static int nendpoints;
+
+static struct {
+    ExtState state;
+    int fd;
+    int endpoint;		/* endpoint asked now or last successfully */
+    int tries;			/* endpoints asked in this round */
+    char req[512];
+    int reqlen, sent;
+    char buf[2048];
+    int fill;
+    char addr[INET6_ADDRSTRLEN];	/* cached address, empty if unknown */
+    long long stamp;		/* when the cached address was confirmed */
+    unsigned int route;		/* route generation it was confirmed under */
+    int failures;		/* failed rounds in a row */
+    long long retryAt;		/* no new round before this time ... */
+    unsigned int failRoute;	/* ... unless the route changes */
+} ext = {EXT_IDLE, -1};
+
+/* parse http://host[:port][/path], host may be an [IPv6] literal */
+static int addEndpoint(const char *url)
+{
+    Endpoint *e = &endpoints[nendpoints];
+    const char *host, *rest, *slash;
+    int hostlen;
+
+    if (nendpoints == MAXENDPOINTS || strncmp(url, "http://", 7) != 0) {
+	return 0;
+    }
+    memset(e, 0, sizeof(*e));
+    host = url + 7;
+    slash = host + strcspn(host, "/");
+    if (*host == '[') {
+	rest = memchr(host, ']', slash - host);
+	if (rest == NULL) {
+	    return 0;
+	}
+	host++;
+	hostlen = rest++ - host;
+    } else {
+	rest = host + strcspn(host, ":/");
+	hostlen = rest - host;
+    }
+    if (hostlen == 0 || hostlen >= (int) sizeof(e->host) ||
+	strlen(slash) >= sizeof(e->path)) {
+	return 0;
+    }
+    memcpy(e->host, host, hostlen);
+    if (*rest == ':') {
+	rest++;
+	if (slash == rest || slash - rest >= (int) sizeof(e->port) ||
+	    strspn(rest, "0123456789") != (size_t) (slash - rest)) {
+	    return 0;
+	}
+	memcpy(e->port, rest, slash - rest);
+    } else if (rest != slash) {
+	return 0;
+    } else {
+	strcpy(e->port, "80");
+    }
+    strcpy(e->path, *slash != 0 ? slash : "/");
+    nendpoints++;
+    return 1;
+}
+
+/* ask the built-in endpoints unless -e named others */
+static void addDefaultEndpoints(void)
+{
+    int n;
+
+    if (nendpoints == 0) {
+	for (n = 0; defaultEndpoints[n] != NULL; n++) {
+	    addEndpoint(defaultEndpoints[n]);
+	}
+    }
+}
+
+/* the cached address is renewed after a route change or EXTADDRAGE */
+static int extStale(void)
+{
+    /* without netlink we cannot see the route, so ask more often */
+    int age = nlfd >= 0 ? extMaxAge : min(extMaxAge, 60*5);
+
+    return ext.addr[0] == 0 || ext.route != routeGeneration ||
+	monotonicMs() - ext.stamp >= age * 1000LL;
+}
+
+/* a lookup should be started now */
+static int extDue(void)
+{
+    return ext.state == EXT_IDLE && nendpoints > 0 && !terminating &&
+	extStale() &&
+	(monotonicMs() >= ext.retryAt || ext.failRoute != routeGeneration);
+}
+
+static void closeHttp(void)
+{
+    if (ext.fd >= 0) {
+	unwatchFd(ext.fd);
+	close(ext.fd);
+	ext.fd = -1;
+    }
+    setTimer(TIMER_EXTADDR, -1);
+}
+
+static void askEndpoint(void);
+
+/* no endpoint knew the address, back off */
+static void extGiveUp(void)
+{
+    long long wait;
+
+    closeHttp();
+    ext.state = EXT_IDLE;
+    traceRecord(TRACE_ADDRESS, "", 0);
+    ext.failures++;
+    wait = min((long long) EXTRETRY << min(ext.failures - 1, 16), EXTRETRYMAX);
+    ext.retryAt = monotonicMs() + wait * 1000;
+    ext.failRoute = routeGeneration;
+#if DEB
+    fprintf(stderr, "external address lookup failed, retry in %llds\n", wait);
+#endif
+    refreshPage(EXTADDR);
+}
+
+/* try the next endpoint, give up when all of them failed */
+static void extFailed(void)
+{
+    closeHttp();
+    ext.state = EXT_IDLE;
+    if (++ext.tries < nendpoints) {
+	ext.endpoint = (ext.endpoint + 1) % nendpoints;
+	askEndpoint();
+	return;
+    }
+    extGiveUp();
+}
+
+/* ext.addr is the address now */
+static void extFound(void)
+{
+    closeHttp();
+    ext.state = EXT_IDLE;
+    ext.stamp = monotonicMs();
+    ext.route = routeGeneration;
+    ext.failures = 0;
+    traceRecord(TRACE_ADDRESS, ext.addr, strlen(ext.addr));
+#if DEB
+    fprintf(stderr, "external address %s from %s\n", ext.addr,
+	    endpoints[ext.endpoint].host);
+#endif
+    refreshPage(EXTADDR);
+}
+
+/* copy the value of a response header, empty if it is not there */
+static void httpHeader(const char *headers, const char *name,
+		       char *value, size_t len)
+{
+    const char *p;
+    size_t n = strlen(name), end;
+
+    value[0] = 0;
+    for (p = strstr(headers, "\r\n"); p != NULL; p = strstr(p, "\r\n")) {
+	p += 2;
+	if (strncasecmp(p, name, n) == 0 && p[n] == ':') {
+	    p += n + 1 + strspn(p + n + 1, " \t");
+	    end = min(strcspn(p, "\r"), len - 1);
+	    memcpy(value, p, end);
+	    value[end] = 0;
+	    return;
+	}
+    }
+}
+
+/* the body must be nothing but an IPv4 or IPv6 address */
+static int validAddress(char *text, char *buf)
+{
+    unsigned char addr[16];
+    int i, family = AF_INET;
+
+    text += strspn(text, " \t\r\n");
+    for (i = strlen(text); i > 0 && strchr(" \t\r\n", text[i-1]) != NULL; i--)
+	;
+    text[i] = 0;
+    if (inet_pton(AF_INET, text, addr) != 1) {
+	family = AF_INET6;
+	if (inet_pton(AF_INET6, text, addr) != 1) {
+	    return 0;
+	}
+    }
+    return inet_ntop(family, addr, buf, INET6_ADDRSTRLEN) != NULL;
+}
+
+static int parseResponse(Endpoint *e)
+{
+    char *body;
+    int status;
+
+    ext.buf[ext.fill] = 0;
+    if (sscanf(ext.buf, "HTTP/%*d.%*d %d", &status) != 1) {
+	return 0;
+    }
+    body = strstr(ext.buf, "\r\n\r\n");
+    if (body == NULL) {
+	return 0;
+    }
+    *body = 0;
+    body += 4;
+    if (status == 304 && e->result[0] != 0) {
+	/* not modified: the endpoint still sees the address it sent */
+	strcpy(ext.addr, e->result);
+	return 1;
+    }
+    if (status != 200 || !validAddress(body, e->result)) {
+	e->etag[0] = e->modified[0] = e->result[0] = 0;
+	return 0;
+    }
+    httpHeader(ext.buf, "ETag", e->etag, sizeof(e->etag));
+    httpHeader(ext.buf, "Last-Modified", e->modified, sizeof(e->modified));
+    strcpy(ext.addr, e->result);
+    return 1;
+}
+
+static void onHttp(int fd, unsigned int events)
+{
+    Endpoint *e = &endpoints[ext.endpoint];
+    int res, err = 0;
+    socklen_t len = sizeof(err);
+
+    if (ext.state == EXT_CONNECT) {
+	getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+	res = err != 0 ? -1 :
+	    send(fd, ext.req + ext.sent, ext.reqlen - ext.sent, MSG_NOSIGNAL);
+	if (res < 0) {
+	    if (err != 0 || errno != EAGAIN) {
+		extFailed();
+	    }
+	    return;
+	}
+	ext.sent += res;
+	if (ext.sent == ext.reqlen) {
+	    ext.state = EXT_RECEIVE;
+	    modifyWatch(fd, EPOLLIN);
+	}
+	return;
+    }
+    res = read(fd, ext.buf + ext.fill, sizeof(ext.buf) - 1 - ext.fill);
+    if (res > 0) {
+	ext.fill += res;
+	if (ext.fill < (int) sizeof(ext.buf) - 1) {
+	    return;
+	}
+	/* an address fits easily, a longer response is not one */
+    } else if (res < 0 && errno == EAGAIN) {
+	return;
+    }
+    if (res != 0 || !parseResponse(e)) {
+	extFailed();
+	return;
+    }
+    extFound();
+}
+
+static void connectEndpoint(Endpoint *e)
+{
+    int fd, v6 = strchr(e->host, ':') != NULL;
+
+    /* HTTP/1.0 so the body is never chunked and ends with the connection */
+    ext.reqlen = snprintf(ext.req, sizeof(ext.req),
+			  "GET %s HTTP/1.0\r\nHost: %s%s%s%s%s\r\n"
+			  "User-Agent: lcd/%s\r\nAccept: text/plain\r\n",
+			  e->path, v6 ? "[" : "", e->host, v6 ? "]" : "",
+			  strcmp(e->port, "80") != 0 ? ":" : "",
+			  strcmp(e->port, "80") != 0 ? e->port : "", VERSION);
+    if (e->etag[0] != 0) {
+	ext.reqlen += snprintf(ext.req + ext.reqlen, sizeof(ext.req) - ext.reqlen,
+			       "If-None-Match: %s\r\n", e->etag);
+    }
+    if (e->modified[0] != 0) {
+	ext.reqlen += snprintf(ext.req + ext.reqlen, sizeof(ext.req) - ext.reqlen,
+			       "If-Modified-Since: %s\r\n", e->modified);
+    }
+    ext.reqlen += snprintf(ext.req + ext.reqlen, sizeof(ext.req) - ext.reqlen, "\r\n");
+
+    fd = socket(e->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+	extFailed();
+	return;
+    }
+    if (connect(fd, (struct sockaddr *) &e->addr, e->addrlen) < 0 &&
+	errno != EINPROGRESS) {
+	close(fd);
+	extFailed();
+	return;
+    }
+    ext.fd = fd;
+    ext.sent = ext.fill = 0;
+    ext.state = EXT_CONNECT;
+    watchFd(fd, EPOLLOUT, onHttp);
+    setTimer(TIMER_EXTADDR, HTTPTIMEOUT * 1000);
+}
+
+/* turn a numeric host into the endpoint's socket address */
+static int setEndpointAddr(Endpoint *e, const char *host)
+{
+    struct addrinfo hints, *ai;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+    if (getaddrinfo(host, e->port, &hints, &ai) != 0) {
+	return 0;
+    }
+    memcpy(&e->addr, ai->ai_addr, ai->ai_addrlen);
+    e->addrlen = ai->ai_addrlen;
+    e->resolved = monotonicMs();
+    freeaddrinfo(ai);
+    return 1;
+}
+
+static void askEndpoint(void)
+{
+    Endpoint *e = &endpoints[ext.endpoint];
+    Collector *c = &collectors[COLLECT_RESOLVE];
+
+    if (trace.mode == TRACE_REPLAY) {
+	/* the answer is in the trace */
+	ext.state = EXT_CONNECT;
+	return;
+    }
+    if (e->addrlen != 0 && monotonicMs() - e->resolved < RESOLVEAGE * 1000LL) {
+	connectEndpoint(e);
+    } else if (setEndpointAddr(e, e->host)) {
+	/* a numeric host needs no lookup */
+	connectEndpoint(e);
+    } else if (c->pid == 0) {
+	c->arg = e->host;
+	startCollector(c);
+	if (c->pid == 0) {
+	    extFailed();
+	    return;
+	}
+	ext.state = EXT_RESOLVE;
+	setTimer(TIMER_EXTADDR, HTTPTIMEOUT * 1000);
+    }
+}
+
+/* the resolver collector is done */
+static void onResolved(Collector *c)
+{
+    Endpoint *e = &endpoints[ext.endpoint];
+
+    if (ext.state != EXT_RESOLVE || terminating) {
+	return;
+    }
+    setTimer(TIMER_EXTADDR, -1);
+    if (c->len == 0 || !setEndpointAddr(e, c->result)) {
+	extFailed();
+	return;
+    }
+    connectEndpoint(e);
+}
+
+static void onExtTimer(void)
+{
+    Collector *c = &collectors[COLLECT_RESOLVE];
+
+#if DEB
+    fprintf(stderr, "endpoint %s timed out\n", endpoints[ext.endpoint].host);
+#endif
+    if (ext.state == EXT_RESOLVE) {
+	ext.state = EXT_IDLE;
+	if (c->pid != 0) {
+	    if (c->pid > 0) {
+		kill(-c->pid, SIGTERM);
+	    }
+	    finishCollector(c);
+	}
+    }
+    extFailed();
+}
+
+/* start a round over the endpoints if the cached address is out of date */
+static void lookupExtAddr(void)
+{
+    if (extDue()) {
+	ext.tries = 0;
+	traceRecord(TRACE_LOOKUP, "", 0);
+	askEndpoint();
+    }
+}
+
+/* jobs: the firewall and WLAN commands take seconds, so they are */
+/* spawned and followed through a pidfd while the event loop goes on */
+
+#define JOBTICK 250		/* ms between two progress updates */
+
+typedef void (*JobFunc)(int status);
+
+static char *const firewallOn[] = {"/usr/local/sbin/firewall.sh", NULL};
+static char *const firewallOff[] = {"/usr/local/sbin/firewall-off.sh", NULL};
+
+static struct {
+    pid_t pid;		/* running command, 0 if none */
+    int fd;		/* its pidfd, -1 if the kernel has none */
+    char *title;	/* first line of the JOB page */
+    long long started;
+    int stopping;	/* 1 after SIGTERM, 2 after SIGKILL */
+    int status;		/* wait status of the last command */
+    Display page;	/* page to go back to */
+    JobFunc done;	/* called with the wait status */
+} job = {0, -1};
+
+static void finishJob(int status)
+{
+    if (job.fd >= 0) {
+	unwatchFd(job.fd);
+	close(job.fd);
+	job.fd = -1;
+    }
+    job.pid = 0;
+    job.status = status;
+    setTimer(TIMER_JOB, -1);
+#if DEB
+    fprintf(stderr, "job \"%s\" ended, status %d\n", job.title, status);
+#endif
+    if (job.done != NULL) {
+	job.done(status);
+    }
+    refreshPage(JOB);
+}
+
+static void onJob(int fd, unsigned int events)
+{
+    int status = 0;
+
+    waitpid(job.pid, &status, 0);
+    finishJob(status);
+}
+
+static void onJobTimer(void)
+{
+    long long running = monotonicMs() - job.started;
+    int status = 0;
+
+    if (job.fd < 0 && waitpid(job.pid, &status, WNOHANG) == job.pid) {
+	/* no pidfd, so we look for the end of the job */
+	finishJob(status);
+	return;
+    }
+    if (job.stopping == 0 && running >= JOBTIMEOUT * 1000LL) {
+	kill(-job.pid, SIGTERM);
+	job.stopping = 1;
+    } else if (job.stopping == 1 &&
+	       running >= (JOBTIMEOUT + JOBKILLWAIT) * 1000LL) {
+	kill(-job.pid, SIGKILL);
+	job.stopping = 2;
+    }
+    /* the dots wait while the power prompt is shown */
+    if (powerButtonMode != MODE_POWEROFF) {
+	refreshPage(JOB);
+    }
+    setTimer(TIMER_JOB, JOBTICK);
+}
+
+/* run a command in the background and show the JOB page, */
+/* returns 0 if another job is still running */
+static int startJob(char *title, char *const argv[], JobFunc done)
+{
+    if (job.pid == 0) {
+	job.page = display;
+    }
+    display = JOB;
+    if (job.pid != 0) {
+	return 0;
+    }
+    job.title = title;
+    job.done = done;
+    job.started = monotonicMs();
+    job.stopping = 0;
+    if (trace.mode == TRACE_REPLAY) {
+	/* nothing is run again, the job succeeds at once */
+	job.status = 0;
+	if (done != NULL) {
+	    done(0);
+	}
+	return 1;
+    }
+    job.pid = backend->spawnJob(argv);
+    counters.forks++;
+    if (job.pid < 0) {
+	job.pid = 0;
+	job.status = W_EXITCODE(127, 0);
+	return 1;
+    }
+    job.fd = syscall(SYS_pidfd_open, job.pid, 0);
+    if (job.fd >= 0) {
+	watchFd(job.fd, EPOLLIN, onJob);
+    }
+    setTimer(TIMER_JOB, JOBTICK);
+    return 1;
+}
+
+/* the second line of the JOB page once the command has ended */
+static void jobResult(char *buf)
+{
+    if (WIFEXITED(job.status) && WEXITSTATUS(job.status) == 0) {
+	strcpy(buf, "done");
+    } else if (job.stopping) {
+	strcpy(buf, "timed out");
+    } else if (WIFEXITED(job.status)) {
+	sprintf(buf, "failed, exit %d", WEXITSTATUS(job.status));
+    } else {
+	sprintf(buf, "killed, signal %d", WTERMSIG(job.status));
+    }
+}
+
+#if HMS_PRIVATE
+static char *const cardEject[] = {"cardctl", "eject", "2", NULL};
+static char *const cardInsert[] = {"cardctl", "insert", "2", NULL};
+
+static void wlanDone(int status)
+{
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+	wlan = !wlan;
+    }
+}
+#endif
+
+/* handle a button press or a display timeout and schedule the next refresh */
+static void serverStep(Button button)
+{
+    int i, n, firewall;
+    int disks[MAXDISKS];
+    int fd = serverfd;
+    time_t t;
+    struct tm *tm;
+    char tmp1[50], tmp2[50];
+    char addr[2][INET6_ADDRSTRLEN + IFNAMSIZ];
+    long uptime;
+    int updays, uphours, upminutes;
+
+    /* get the current time */
+    t = wallMs() / 1000;
+    tm = localtime(&t);
+
+    /* control display lighting */
+    if (darkness == WANTSDARK) {
+	/* switch off display now */
+	if (button == TIMEOUT) {
+	    lightLcd(fd, 0);
+	    darkness = DARK;
+	    display = DATETIME;
+	}
+    } else {
+	/* switch on display because somebody pressed a button */
+	/* or we had a timeout */
+	lightLcd(fd, 1);
+	if (darkness == DARK)
+	    darkness = WANTSDARK;
+    }
+    if (tm->tm_hour < DARKUNTIL) {
+	/* dark between midnight and DARKUNTIL */
+	if (darkness == LIGHT) {
+	    /* we need to switch from light to dark */
+	    darkness = WANTSDARK;
+	}
+    } else {
+	darkness = LIGHT;
+    }
+#if DEB
+    fprintf(stderr, "button=%d, darkness=%d\n", button, darkness);
 #endif 
-	switch (button) {
-	case POWERBUTTON:
-	    /* power button was pressed */
-	    switch (powerButtonMode) {
-	    case MODE_FANOFF:
-		/* toggle fan control */
-		if (fanControl == ALWAYSON) {
-		    fanControl = CONTROLLED;
-		} else if (fanControl == CONTROLLED) {
-		    finishFanControl(FANON);
-		    fanControl = ALWAYSON; 
+    switch (button) {
+    case POWERBUTTON:
+	/* power button was pressed */
+	switch (powerButtonMode) {
+	case MODE_FANOFF:
+	    /* toggle fan control */
+	    if (fanControl == ALWAYSON) {
+		fanControl = CONTROLLED;
+	    } else if (fanControl == CONTROLLED) {
+		switchFans(FANON);
+		fanControl = ALWAYSON;
+	    }
+	    powerButtonMode = MODE_NONE;
+	    delay = 0;
+	    fani = 10;
+	    break;
+	case MODE_FIREWALL:
+	    /* the script runs in the background, see the JOB page */
+	    if (firewall_is_on()) {
+	    /* turn off firewall by running script */
+	      startJob("Firewall off", firewallOff, NULL);
+	    } else {
+	    /* turn on firewall by running script */
+	      startJob("Firewall on", firewallOn, NULL);
+	    }
+	    powerButtonMode = MODE_NONE;
+	    delay = 0;
+	    fani = 10;
+	    break;
+#if HMS_PRIVATE
+	case MODE_WLANOFF:
+	    /* toggle wlan by ejecting/inserting the PCMCIA card, */
+	    /* wlanDone() flips wlan if cardctl succeeds */
+	    if (wlan == 1) {
+		startJob("WLAN off", cardEject, wlanDone);
+	    } else {
+		startJob("WLAN on", cardInsert, wlanDone);
+	    }
+	    powerButtonMode = MODE_NONE;
+	    delay = 0;
+	    fani = 10;
+	    break;
+#endif
+	default:
+	    writeLcd(fd, "Power: Off", "Display: Restart");
+	    /* a second button must be pressed within 3 seconds */
+	    powerButtonMode = MODE_POWEROFF;
+	    powerDeadline = monotonicMs() + DOUBLEPRESS;
+	    delay = DOUBLEPRESS / 1000;
+	}
+	break;
+
+    case POWERTWICE:
+	/* power off the system */
+	writeLcd(fd, "Shutting", "down system");
+#if !TEST
+	/* we do a shutdown and wait until we are killed */
+	/* the signal handler then will use the LCD stuff */
+	/* to powerdown the system in such a way that the */
+	/* we can switch it on with the power button again */
+	if (trace.mode != TRACE_REPLAY) {
+	    lcdfd = fd;
+	    backend->power(0);
+	}
+#endif
+	/* still here: the next press starts over */
+	powerButtonMode = MODE_NONE;
+	break;
+
+    case POWERSELECT:
+	/* reboot the system */
+	writeLcd(fd, "Restarting", "system");
+#if !TEST
+	if (trace.mode != TRACE_REPLAY) {
+	    backend->power(1);
+	}
+#endif
+	powerButtonMode = MODE_NONE;
+	break;
+
+    case SELECTLONG:
+    case SELECTBUTTON:
+	/* display button was pressed, held down it goes back to the start */
+	display = button == SELECTLONG || display >= LASTDISPLAY ?
+	    DATETIME : display + 1;
+	fani = 0;
+	powerButtonMode = MODE_NONE;
+	/* fall through */
+
+    case REFRESH:
+	/* new data for a page must not wipe a pending power prompt, */
+	/* only the timeout or a button press cancels it */
+	if (powerButtonMode == MODE_POWEROFF) {
+	    return;
+	}
+	/* fall through */
+
+    case TIMEOUT:
+	/* timeout */
+	/* cancel power down cycle */
+	powerButtonMode = MODE_NONE;
+	switch (display) {
+	case TEMPS:
+	  {
+	    /* write temperatures */
+	    int cputemp = readSysTemp(CPUTEMPINP);
+	    int systemp = readSysTemp(SYSTEMPINP);
+	    if (tempunit == FAHRENHEIT) {
+	      cputemp = ((float)cputemp * 1.8) + 32;
+	      systemp = ((float)systemp * 1.8) + 32;
+	    }
+	    sprintf(tmp2, "CPU %d, Sys %d", cputemp, systemp);
+	    writeLcd(fd, "Temperature", tmp2);
+	    delay = fanControl == ALWAYSON? 60 : 10;
+	    break;
+	  }
+
+	case TEMPTREND:
+	    /* min/max/avg and sparkline, CPU and system in turn */
+	    i = fani++ % 2;
+	    trendLines(i == 0 ? HIST_CPUTEMP : HIST_SYSTEMP,
+		       i == 0 ? "CPU" : "Sys", tmp1, tmp2);
+	    writeLcd(fd, tmp1, tmp2);
+	    delay = 5;
+	    break;
+
+	case FANTREND:
+	    i = fani++ % 2;
+	    trendLines(i == 0 ? HIST_CPUFAN : HIST_SYSFAN,
+		       i == 0 ? "CPU" : "Sys", tmp1, tmp2);
+	    writeLcd(fd, tmp1, tmp2);
+	    delay = 5;
+	    break;
+
+	case FANS:
+	    /* write fan revolutions */
+	    sprintf(tmp1, "CPU fan %4d",
+		    (int) readSys(CPUFANINP));
+	    sprintf(tmp2, "Sys fan %4d",
+		    (int) readSys(SYSFANINP));
+	    for (i = CPUFAN; i < LASTFAN; i++) {
+		if (fanControl == CONTROLLED && fan[i].duty >= 0) {
+		    /* and how hard we drive it */
+		    sprintf(i == CPUFAN ? tmp1 : tmp2, "%s %5d %3d%%",
+			    i == CPUFAN ? "CPU" : "Sys",
+			    (int) readSys(i == CPUFAN ? CPUFANINP : SYSFANINP),
+			    (fan[i].duty * 100 + PWMMAX / 2) / PWMMAX);
+		}
+	    }
+	    writeLcd(fd, tmp1, tmp2);
+	    delay = fanControl == ALWAYSON? 120 : 10;
+	    break;
+
+	case FANCTL:
+	    /* offer fan control setting */
+	    if (fanControl == UNAVAILABLE) {
+		display++;
+		/* fall through */
+	    } else {
+		powerButtonMode = MODE_FANOFF;
+		delay = 2;
+		if ((fani++ % 2) == 0) {
+		    writeLcd(fd, "Fans are",
+			     fanControl == CONTROLLED?
+			     "controlled" : "always on");
+		    if (fani > 10) {
+			/* we have seen it five times - that's enough */
+			fani = 0;
+			display = FANS;
+			delay = 5;
+		    }
+		} else {
+		    writeLcd(fd, "Power button", "to toggle");
+		}
+		break;
+	    }
+
+	case DISKTEMPS:
+	    /* write harddisk temperatures, two disks per screen */
+	    collectDisks();
+	    for (i = n = 0; i < MAXDISKS; i++) {
+		if (diskNames[i][0] != 0) {
+		    disks[n++] = i;
+		}
+	    }
+	    if (button == TIMEOUT) {
+		/* rotate to the next two disks */
+		fani++;
+	    }
+	    i = 2 * (fani % max((n + 1) / 2, 1));
+	    if (n == 0) {
+		writeLcd(fd, "Disk temperature", "no disks");
+	    } else if (n == 1) {
+		diskLine(disks[0], tmp2);
+		writeLcd(fd, "Disk temperature", tmp2);
+	    } else {
+		diskLine(disks[i], tmp1);
+		if (i + 1 < n) {
+		    diskLine(disks[i + 1], tmp2);
+		}
+		writeLcd(fd, tmp1, i + 1 < n ? tmp2 : NULL);
+	    }
+	    delay = n > 2 ? 5 : diskMaxAge;
+	    break;
+
+	case EXTADDR:
+	    /* write external address, asked for only when it is */
+	    /* old or the default route has changed */
+	    lookupExtAddr();
+	    delay = 60;
+	    if (ext.addr[0] != 0 && ext.route == routeGeneration) {
+		if (strlen(ext.addr) <= LINELEN) {
+		    writeLcd(fd, "External IP Addr", ext.addr);
+		} else {
+		    splitAddress(ext.addr, tmp1, tmp2);
+		    writeLcd(fd, tmp1, tmp2);
+		}
+	    } else if (ext.state != EXT_IDLE) {
+		writeLcd(fd, "External IP Addr", "waiting ...");
+		delay = HTTPTIMEOUT;
+	    } else {
+		writeLcd(fd, "External IP Addr", "None");
+	    }
+	    break;
+
+	case LANADDR:
+	    /* show LAN (internal) addresses */
+	    /* the interface table is updated by netlink events, */
+	    /* which redraw the page when an address changes */
+	    delay = 60*5;
+	    for (i = 0; i < 2; i++) {
+		if (!lanAddress(lanif[i], addr[i], sizeof(addr[i]))) {
+		    snprintf(addr[i], sizeof(addr[i]), "%s ???", lanif[i]);
+		}
+	    }
+	    if (strlen(addr[0]) <= LINELEN && strlen(addr[1]) <= LINELEN) {
+		writeLcd(fd, addr[0], addr[1]);
+	    } else {
+		/* an IPv6 address needs both lines, */
+		/* so show one interface at a time */
+		i = fani++ % 2;
+		splitAddress(addr[i], tmp1, tmp2);
+		writeLcd(fd, tmp1, tmp2);
+		delay = 5;
+	    }
+	    break;
+
+	case UPTIME:
+	    /* write system uptime */
+	    uptime = uptimeSeconds();
+	    updays = (int) uptime / (60*60*24);
+	    upminutes = (int) uptime / 60;
+	    uphours = (upminutes / 60) % 24;
+	    upminutes %= 60;
+	    sprintf(tmp1, "%d day%s, %02d:%02d", updays,
+		    (updays != 1) ? "s" : "",
+		    uphours, upminutes);
+	    writeLcd(fd, "Uptime", tmp1);
+	    delay = 60*5; /* every 5 minutes */
+	    break;
+
+	case FIREWALLCTL:
+	    /* offer Firewall control setting */
+	    firewall = firewall_is_on();
+	    powerButtonMode = MODE_FIREWALL;
+	    delay = 2;
+	    if ((fani++ % 2) == 0) {
+		writeLcd(fd, "Firewall is",
+			 firewall? "enabled": "disabled");
+		if (fani > 10) {
+		    /* we have seen it five times - that's enough */
+		    fani = 0;
+		    display = DATETIME;
+		    delay = 5;
+		}
+	    } else {
+		writeLcd(fd, "Power button to",
+			 firewall? "turn OFF": "turn ON");
+	    }
+	    break;
+
+#if HMS_PRIVATE
+	case WLANCTL:
+	    /* offer WLAN control setting */
+	    powerButtonMode = MODE_WLANOFF;
+	    delay = 2;
+	    if ((fani++ % 2) == 0) {
+		writeLcd(fd, "Wireless LAN is",
+			 wlan? "enabled": "disabled");
+		if (fani > 10) {
+		    /* we have seen it five times - that's enough */
+		    fani = 0;
+		    display = DATETIME;
+		    delay = 5;
+		}
+	    } else {
+		writeLcd(fd, "Power button to",
+			 wlan? "disable WLAN": "enable WLAN");
+	    }
+	    break;
+#endif
+
+	case MESSAGE:
+	    /* show what a client wrote until a button is pressed */
+	    writeLcd(fd, message[0], message[1]);
+	    delay = 60;
+	    break;
+
+	case JOB:
+	    /* show a running command with dots and seconds, */
+	    /* then how it ended before going back */
+	    if (job.pid != 0) {
+		long long running = monotonicMs() - job.started;
+		sprintf(tmp2, "%-3.*s %4llds", (int) (running / JOBTICK % 4),
+			"...", running / 1000);
+		writeLcd(fd, job.title, tmp2);
+		/* the job timer redraws */
+		delay = 60;
+	    } else {
+		jobResult(tmp2);
+		writeLcd(fd, job.title, tmp2);
+		display = job.page;
+		delay = 3;
+	    }
+	    break;
+
+	case DATETIME:
+	default:
+	    /* write date and time */
+	    strftime(tmp1, sizeof(tmp1), "%a %d-%b-%Y ", tm);
+	    strftime(tmp2, sizeof(tmp2), TIMEFORMAT, tm);
+	    writeLcd(fd, tmp1, tmp2);
+	    if (darkness == DARK) {
+		/* wait until 07:00 */
+		delay = 3600 * (DARKUNTIL - tm->tm_hour)
+		    - tm->tm_min * 60 - tm->tm_sec;
+	    } else {
+		/* wait a minute */
+		delay = 60;
+	    }
+	    /* restart display cycle */
+	    display = DATETIME;
+	    break;
+
+	}
+	break;
+    }
+    if (darkness == WANTSDARK) {
+	/* switch off display in two seconds  */
+	delay = 10;
+    }
+    if (darkness != DARK && display < LASTDISPLAY && !terminating) {
+	prefetchPage(nextPage(display));
+    }
+#if DEB
+    fprintf(stderr, "darkness=%d, delay=%d\n", darkness, delay);
+#endif 
+    setTimer(TIMER_DISPLAY, delay * 1000);
+}
+
+/* the control socket: local clients write to the display, follow the */
+/* buttons, read sensors and switch pages through the running server */
+
+#define CONTROLSOCKET "/var/run/lcd.sock"
+#define MAXCLIENTS 8
+
+typedef struct {
+    int fd;		/* -1 if the slot is free */
+    int subscribed;	/* wants to hear about button presses */
+    int len;
+    char buf[256];	/* a partial command line */
+} Client;
+
+static Client clients[MAXCLIENTS];
+static const char *controlSocket;	/* -c, else the backend's or ours */
+
+/* names of the pages for the page command, in Display order */
+static const char *pageNames[] = {
+    "datetime", "temps", "temptrend", "fans", "fantrend", "fanctl", "disks",
+    "extaddr", "lanaddr", "uptime", "firewall", "wlan"
+};
+
+/* a tab or newline in a message would end the line or the command, */
+/* an escape would reach the panel as one of its commands */
+static int hasControl(const char *s)
+{
+    for (; *s != 0; s++) {
+	if (iscntrl((unsigned char) *s)) {
+	    return 1;
+	}
+    }
+    return 0;
+}
+
+static void reply(Client *c, const char *text)
+{
+    send(c->fd, text, strlen(text), MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+static void dropClient(Client *c)
+{
+    unwatchFd(c->fd);
+    close(c->fd);
+    c->fd = -1;
+}
+
+/* tell the subscribers about a button press */
+static void notifyButton(Button button)
+{
+    int i;
+
+    for (i = 0; i < MAXCLIENTS; i++) {
+	if (clients[i].fd >= 0 && clients[i].subscribed) {
+	    reply(&clients[i], button == POWERBUTTON ? "power\n" : "display\n");
+	}
+    }
+}
+
+/* the value of a sensor or of a cached disk temperature */
+static int querySensor(const char *name, char *buf)
+{
+    int i;
+    Collector *c;
+
+    if (strcmp(name, "cputemp") == 0) {
+	sprintf(buf, "%d\n", readSysTemp(CPUTEMPINP));
+    } else if (strcmp(name, "systemp") == 0) {
+	sprintf(buf, "%d\n", readSysTemp(SYSTEMPINP));
+    } else if (strcmp(name, "cpufan") == 0) {
+	sprintf(buf, "%ld\n", readSys(CPUFANINP));
+    } else if (strcmp(name, "sysfan") == 0) {
+	sprintf(buf, "%ld\n", readSys(SYSFANINP));
+    } else if ((i = findDisk(name)) >= 0) {
+	c = &collectors[COLLECT_DISKS + i];
+	if (!c->ready || c->len == 0) {
+	    return 0;
+	}
+	sprintf(buf, "%d\n", atoi(c->result));
+    } else {
+	return 0;
+    }
+    return 1;
+}
+
+static void runCommand(Client *c, char *line)
+{
+    char *arg = strchr(line, ' ');
+    char buf[32];
+    int i;
+
+    if (arg != NULL) {
+	*arg++ = 0;
+    }
+    if (strcmp(line, "write") == 0 && arg != NULL) {
+	/* the two lines are separated by a tab */
+	char *line2 = strchr(arg, '\t');
+	if (line2 != NULL) {
+	    *line2++ = 0;
+	}
+	if (hasControl(arg) || (line2 != NULL && hasControl(line2))) {
+	    reply(c, "error control character\n");
+	    return;
+	}
+	snprintf(message[0], sizeof(message[0]), "%s", arg);
+	snprintf(message[1], sizeof(message[1]), "%s", line2 != NULL ? line2 : "");
+	/* a stream writes many times a second, so a pending power */
+	/* prompt stays; the message is shown when the prompt ends */
+	display = MESSAGE;
+	serverStep(REFRESH);
+	reply(c, "ok\n");
+    } else if (strcmp(line, "subscribe") == 0) {
+	c->subscribed = 1;
+	reply(c, "ok\n");
+    } else if (strcmp(line, "sensor") == 0 && arg != NULL) {
+	reply(c, querySensor(arg, buf) ? buf : "error no such sensor\n");
+    } else if (strcmp(line, "page") == 0 && arg != NULL) {
+	for (i = 0; i < LASTDISPLAY && strcmp(arg, pageNames[i]) != 0; i++)
+	    ;
+	if (i == LASTDISPLAY) {
+	    reply(c, "error no such page\n");
+	    return;
+	}
+	display = i;
+	fani = 0;
+	powerButtonMode = MODE_NONE;
+	serverStep(REFRESH);
+	reply(c, "ok\n");
+    } else {
+	reply(c, "error unknown command\n");
+    }
+}
+
+static void onClient(int fd, unsigned int events)
+{
+    Client *c = NULL;
+    char *nl;
+    int i, res;
+
+    for (i = 0; i < MAXCLIENTS && c == NULL; i++) {
+	if (clients[i].fd == fd) {
+	    c = &clients[i];
+	}
+    }
+    if (c == NULL) {
+	return;
+    }
+    res = read(fd, c->buf + c->len, sizeof(c->buf) - 1 - c->len);
+    if (res <= 0) {
+	if (res == 0 || errno != EAGAIN) {
+	    dropClient(c);
+	}
+	return;
+    }
+    c->len += res;
+    c->buf[c->len] = 0;
+    while ((nl = strchr(c->buf, '\n')) != NULL) {
+	*nl = 0;
+	runCommand(c, c->buf);
+	c->len -= nl + 1 - c->buf;
+	memmove(c->buf, nl + 1, c->len + 1);
+    }
+    if (c->len == sizeof(c->buf) - 1) {
+	/* no command is that long */
+	dropClient(c);
+    }
+}
+
+static void onListen(int fd, unsigned int events)
+{
+    int i, cfd;
+
+    cfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (cfd < 0) {
+	return;
+    }
+    for (i = 0; i < MAXCLIENTS; i++) {
+	if (clients[i].fd < 0) {
+	    clients[i].fd = cfd;
+	    clients[i].subscribed = 0;
+	    clients[i].len = 0;
+	    watchFd(cfd, EPOLLIN, onClient);
+	    return;
+	}
+    }
+    /* too many clients */
+    close(cfd);
+}
+
+static int connectServer(void);
+
+static int initControl(void)
+{
+    struct sockaddr_un sun;
+    int i, fd;
+
+    for (i = 0; i < MAXCLIENTS; i++) {
+	clients[i].fd = -1;
+    }
+    if ((fd = connectServer()) >= 0) {
+	/* the socket is not left over, it is another server's */
+	fprintf(stderr, "%s: another server is running\n", controlSocket);
+	close(fd);
+	return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+	perror("control socket()");
+	return -1;
+    }
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", controlSocket);
+    unlink(controlSocket);
+    if (bind(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0 || listen(fd, 4) < 0) {
+	perror(controlSocket);
+	close(fd);
+	return -1;
+    }
+    /* the same people who may use the tty may talk to us */
+    chmod(controlSocket, 0660);
+    watchFd(fd, EPOLLIN, onListen);
+    return fd;
+}
+
+static void finishControl(int fd)
+{
+    int i;
+
+    for (i = 0; i < MAXCLIENTS; i++) {
+	if (clients[i].fd >= 0) {
+	    dropClient(&clients[i]);
+	}
+    }
+    if (fd >= 0) {
+	close(fd);
+	unlink(controlSocket);
+    }
+}
+
+/* client side: connect to the server, -1 if none is running */
+static int connectServer(void)
+{
+    struct sockaddr_un sun;
+    int fd;
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+	return -1;
+    }
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", controlSocket);
+    if (connect(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0) {
+	close(fd);
+	return -1;
+    }
+    return fd;
+}
+
+/* read one reply line, waiting at most waitSecs seconds (-1 forever) */
+static int readReply(int fd, char *buf, int len, int waitSecs)
+{
+    int res, n = 0;
+
+    while (n < len - 1) {
+	if (!waitFor(fd, waitSecs)) {
+	    return 0;
+	}
+	res = read(fd, buf + n, 1);
+	if (res <= 0) {
+	    return 0;
+	}
+	if (buf[n] == '\n') {
+	    break;
+	}
+	n++;
+    }
+    buf[n] = 0;
+    return 1;
+}
+
+/* send one command and print the answer, -1 if there is no server */
+static int request(const char *command, char *answer, int len)
+{
+    int fd = connectServer();
+
+    if (fd < 0) {
+	return -1;
+    }
+    write(fd, command, strlen(command));
+    if (!readReply(fd, answer, len, 5)) {
+	strcpy(answer, "error no reply");
+    }
+    close(fd);
+    return 0;
+}
+
+/* button input: every byte from the panel becomes a timestamped event */
+/* in a ring, and each event is handled exactly once */
+
+#define EVENTRING 32
+#define DEBOUNCE 30		/* ms, a closer second press is contact bounce */
+#define REPEATGAP 120		/* ms, closer presses mean the button is held */
+#define LONGPRESS 1000		/* ms a button must be held for a long press */
+
+typedef struct {
+    Button button;
+    long long when;		/* CLOCK_MONOTONIC milliseconds */
+    int burst;			/* read together with the previous event */
+} ButtonEvent;
+
+static ButtonEvent ring[EVENTRING];
+static unsigned int ringHead, ringTail;
+
+static void pushEvent(Button button, long long when, int burst)
+{
+    if (ringTail - ringHead == EVENTRING) {
+	/* full, the oldest press is lost */
+	ringHead++;
+    }
+    ring[ringTail % EVENTRING].button = button;
+    ring[ringTail % EVENTRING].when = when;
+    ring[ringTail % EVENTRING].burst = burst;
+    ringTail++;
+}
+
+/* turn an event into what the server acts on, TIMEOUT if it is swallowed */
+static Button recognize(ButtonEvent *e)
+{
+    static Button last;
+    static long long lastWhen, holdStart;
+    static int longDone;
+    long long gap = e->when - lastWhen;
+
+    if (e->button == last && !e->burst && gap < REPEATGAP) {
+	if (gap < DEBOUNCE) {
+	    return TIMEOUT;
+	}
+	/* the panel repeats a held button */
+	lastWhen = e->when;
+	if (!longDone && e->when - holdStart >= LONGPRESS) {
+	    longDone = 1;
+	    return e->button == SELECTBUTTON ? SELECTLONG : TIMEOUT;
+	}
+	return TIMEOUT;
+    }
+    last = e->button;
+    lastWhen = holdStart = e->when;
+    longDone = 0;
+    if (powerButtonMode == MODE_POWEROFF && e->when < powerDeadline) {
+	/* the second button after the power off prompt */
+	return e->button == POWERBUTTON ? POWERTWICE : POWERSELECT;
+    }
+    return e->button;
+}
+
+static void onLcd(int fd, unsigned int events)
+{
+    int i, res;
+    char buf[20];
+    long long now, readAt = 0;
+    Button button;
+
+    if (events & EPOLLOUT) {
+	flushLcd(fd);
+    }
+    if (events & EPOLLIN) {
+	now = monotonicMs();
+	readAt = nowUs();
+	while ((res = read(fd, buf, sizeof(buf))) > 0) {
+	    traceRecord(TRACE_IN, buf, res);
+	    for (i = 0; i < res; i++) {
+		/* anything else on the line is noise */
+		if (buf[i] == POWERBUTTON || buf[i] == SELECTBUTTON) {
+		    pushEvent(buf[i], now, i > 0);
 		}
-		powerButtonMode = MODE_NONE;
-		wait = 0;
-		fani = 10;
-		break;
-	    case MODE_FIREWALL:
-	        if (firewall_is_on()) {
-		/* turn off firewall by running script */
-		  system("/usr/local/sbin/firewall-off.sh");
+	    }
+	}
+	while (ringHead != ringTail && !terminating) {
+	    button = recognize(&ring[ringHead++ % EVENTRING]);
+	    if (button == POWERBUTTON || button == SELECTBUTTON) {
+		notifyButton(button);
+	    }
+	    if (button != TIMEOUT) {
+		serverStep(button);
+		if (outHead < outTail) {
+		    /* counted when the UART has taken it */
+		    buttonAt = readAt;
 		} else {
-		/* turn on firewall by running script */
-		  system("/usr/local/sbin/firewall.sh");
+		    recordLatency(&probes[PROBE_BUTTON], nowUs() - readAt);
 		}
-		powerButtonMode = MODE_NONE;
-		wait = 0;
-		fani = 10;
+	    }
+	}
+    }
+}
+
+/* the snapshot for other programs, see lcdshm.h: written under a */
+/* sequence count, so readers retry instead of taking a lock */
+
+static LcdShm *shm;
+static const char *snapshotFile = LCDSHMFILE;	/* the backend may move it */
+
+static void openSnapshot(void)
+{
+    int fd;
+    void *map = MAP_FAILED;
+
+    fd = open(snapshotFile, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd >= 0 && ftruncate(fd, sizeof(LcdShm)) == 0) {
+	map = mmap(NULL, sizeof(LcdShm), PROT_READ | PROT_WRITE,
+		   MAP_SHARED, fd, 0);
+    }
+    if (fd >= 0) {
+	close(fd);
+    }
+    if (map == MAP_FAILED) {
+	perror(snapshotFile);
+	return;
+    }
+    shm = map;
+    memset(shm, 0, sizeof(LcdShm));
+    shm->size = sizeof(LcdShm);
+    /* readers check the magic last */
+    __atomic_store_n(&shm->magic, LCDSHMMAGIC, __ATOMIC_RELEASE);
+}
+
+static void closeSnapshot(void)
+{
+    if (shm != NULL) {
+	unlink(snapshotFile);
+	munmap(shm, sizeof(LcdShm));
+	shm = NULL;
+    }
+}
+
+/* wall clock time of a monotonic stamp */
+static long long wallStamp(long long stamp, long long now, long long wall)
+{
+    return stamp == 0 ? 0 : wall - (now - stamp);
+}
+
+static void publishSnapshot(void)
+{
+    long long now = monotonicMs(), wall = wallMs();
+    Collector *c;
+    int i;
+
+    if (shm == NULL) {
+	return;
+    }
+    __atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    shm->stamp = wall;
+    shm->sensorStamp = lastSampleTime;
+    shm->cpuTemp = lastSample[HIST_CPUTEMP];
+    shm->sysTemp = lastSample[HIST_SYSTEMP];
+    shm->cpuFan = lastSample[HIST_CPUFAN];
+    shm->sysFan = lastSample[HIST_SYSFAN];
+    shm->cpuFanOn = fanControl == CONTROLLED ? fan[CPUFAN].mode == FANON : -1;
+    shm->sysFanOn = fanControl == CONTROLLED ? fan[SYSFAN].mode == FANON : -1;
+    shm->uptime = uptimeSeconds();
+    for (i = 0; i < LCDSHMDISKS && i < MAXDISKS; i++) {
+	c = &collectors[COLLECT_DISKS + i];
+	memcpy(shm->disks[i].name, diskNames[i], sizeof(shm->disks[i].name));
+	shm->disks[i].temp = c->ready && c->len > 0 ? atoi(c->result) : -1;
+	shm->disks[i].stamp = c->ready ? wallStamp(c->stamp, now, wall) : 0;
+    }
+    snprintf(shm->extAddr, sizeof(shm->extAddr), "%s", ext.addr);
+    shm->extStamp = ext.addr[0] != 0 ? wallStamp(ext.stamp, now, wall) : 0;
+    for (i = 0; i < 2; i++) {
+	snprintf(shm->lanIf[i], sizeof(shm->lanIf[i]), "%s", lanif[i]);
+	if (!lanAddress(lanif[i], shm->lanAddr[i], sizeof(shm->lanAddr[i]))) {
+	    shm->lanAddr[i][0] = 0;
+	}
+    }
+
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELAXED);
+}
+
+/* metrics: every METRICSINTERVAL the cached readings and our counters */
+/* are written in the Prometheus text format for the node_exporter */
+/* textfile collector. Only the cache is used, writing never samples */
+/* a sensor. */
+
+static const char *metricsFile;		/* NULL unless -m is given */
+static int metricsInterval = METRICSINTERVAL;
+
+static void writeMetrics(void)
+{
+    char tmp[255];
+    FILE *f;
+    int i;
+    static const char *names[LASTHISTORY] = {"cpu", "sys", "cpu", "sys"};
+
+    snprintf(tmp, sizeof(tmp), "%.240s.tmp", metricsFile);
+    f = fopen(tmp, "w");
+    if (f == NULL) {
+	perror(tmp);
+	return;
+    }
+    fprintf(f, "# TYPE lcd_temperature_celsius gauge\n");
+    for (i = HIST_CPUTEMP; i <= HIST_SYSTEMP; i++) {
+	if (lastSample[i] >= 0) {
+	    fprintf(f, "lcd_temperature_celsius{sensor=\"%s\"} %d\n",
+		    names[i], lastSample[i]);
+	}
+    }
+    fprintf(f, "# TYPE lcd_fan_rpm gauge\n");
+    for (i = HIST_CPUFAN; i <= HIST_SYSFAN; i++) {
+	if (lastSample[i] >= 0) {
+	    fprintf(f, "lcd_fan_rpm{fan=\"%s\"} %d\n", names[i], lastSample[i]);
+	}
+    }
+    if (fanControl == CONTROLLED) {
+	fprintf(f, "# TYPE lcd_fan_on gauge\n");
+	for (i = 0; i < LASTFAN; i++) {
+	    fprintf(f, "lcd_fan_on{fan=\"%s\"} %d\n",
+		    i == CPUFAN ? "cpu" : "sys", fan[i].mode == FANON);
+	}
+	fprintf(f, "# TYPE lcd_fan_duty_ratio gauge\n");
+	for (i = 0; i < LASTFAN; i++) {
+	    if (fan[i].duty >= 0) {
+		fprintf(f, "lcd_fan_duty_ratio{fan=\"%s\"} %.3f\n",
+			i == CPUFAN ? "cpu" : "sys", (double) fan[i].duty / PWMMAX);
+	    }
+	}
+    }
+    fprintf(f, "# TYPE lcd_fan_writes_total counter\n"
+	    "lcd_fan_writes_total %llu\n", counters.fanWrites);
+    fprintf(f, "# TYPE lcd_disk_temperature_celsius gauge\n");
+    for (i = 0; i < MAXDISKS; i++) {
+	Collector *c = &collectors[COLLECT_DISKS + i];
+	if (diskNames[i][0] != 0 && c->ready && c->len > 0) {
+	    fprintf(f, "lcd_disk_temperature_celsius{disk=\"%s\"} %d\n",
+		    diskNames[i], atoi(c->result));
+	}
+    }
+    fprintf(f, "# TYPE lcd_sensor_timestamp_seconds gauge\n"
+	    "lcd_sensor_timestamp_seconds %lld.%03lld\n",
+	    lastSampleTime / 1000, lastSampleTime % 1000);
+    fprintf(f, "# TYPE lcd_loop_iterations_total counter\n"
+	    "lcd_loop_iterations_total %llu\n", counters.loops);
+    fprintf(f, "# TYPE lcd_serial_bytes_total counter\n"
+	    "lcd_serial_bytes_total %llu\n", counters.serialBytes);
+    fprintf(f, "# TYPE lcd_forks_total counter\n"
+	    "lcd_forks_total %llu\n", counters.forks);
+    fprintf(f, "# TYPE lcd_collector_seconds summary\n"
+	    "lcd_collector_seconds_sum %lld.%06lld\n"
+	    "lcd_collector_seconds_count %llu\n",
+	    counters.collectUs / 1000000, counters.collectUs % 1000000,
+	    counters.collections);
+    fprintf(f, "# TYPE lcd_thermal_deadlines_missed_total counter\n"
+	    "lcd_thermal_deadlines_missed_total %llu\n", counters.thermalMissed);
+    /* the collector must never see half a file */
+    if (fclose(f) != 0 || rename(tmp, metricsFile) < 0) {
+	perror(metricsFile);
+	unlink(tmp);
+    }
+}
+
+static void onMetricsTimer(void)
+{
+    writeMetrics();
+    setTimer(TIMER_METRICS, metricsInterval * 1000);
+}
+
+/* print the snapshot of the running server, one value per line */
+static int dumpSnapshot(void)
+{
+    const LcdShm *map = lcdshmOpen(snapshotFile);
+    LcdShm s;
+    int i;
+
+    if (map == NULL) {
+	fprintf(stderr, "no snapshot in %s\n", snapshotFile);
+	return 0;
+    }
+    if (!lcdshmRead(map, &s)) {
+	fprintf(stderr, "snapshot keeps changing\n");
+	lcdshmClose(map);
+	return 0;
+    }
+    lcdshmClose(map);
+    printf("stamp %lld\n", (long long) s.stamp);
+    printf("sensors %lld\n", (long long) s.sensorStamp);
+    printf("cputemp %d\nsystemp %d\n", s.cpuTemp, s.sysTemp);
+    printf("cpufan %d\nsysfan %d\n", s.cpuFan, s.sysFan);
+    printf("cpufanon %d\nsysfanon %d\n", s.cpuFanOn, s.sysFanOn);
+    printf("uptime %lld\n", (long long) s.uptime);
+    for (i = 0; i < LCDSHMDISKS; i++) {
+	if (s.disks[i].name[0] != 0) {
+	    printf("disk %.32s %d %lld\n", s.disks[i].name, s.disks[i].temp,
+		   (long long) s.disks[i].stamp);
+	}
+    }
+    printf("extaddr %s %lld\n", s.extAddr[0] != 0 ? s.extAddr : "-",
+	   (long long) s.extStamp);
+    for (i = 0; i < 2; i++) {
+	printf("lanaddr %.16s %s\n", s.lanIf[i],
+	       s.lanAddr[i][0] != 0 ? s.lanAddr[i] : "-");
+    }
+    return 1;
+}
+
+static long long fanDue;	/* when the thermal check should run */
+
+static void onFanTimer(void)
+{
+    long long start = nowUs();
+
+    controlFans();
+    recordLatency(&probes[PROBE_FANS], nowUs() - start);
+    if (fanDue != 0 && monotonicMs() - fanDue > THERMALSLACK) {
+	counters.thermalMissed++;
+    }
+    fanDue = monotonicMs() + FANINTERVAL * 1000;
+    setTimer(TIMER_FANS, FANINTERVAL * 1000);
+}
+
+/* one line per histogram: count, mean, max and the bucket bounds */
+/* of the median and the 90th and 99th percentile, all in us */
+static void formatLatency(char *buf, int len, const char *name, const Histogram *h)
+{
+    snprintf(buf, len, "%s count %llu mean %lld max %lld p50 %lld p90 %lld p99 %lld",
+	     name, h->count, h->count > 0 ? h->sum / (long long) h->count : 0,
+	     h->max, percentile(h, 0.5), percentile(h, 0.9), percentile(h, 0.99));
+}
+
+static void logLatency(FILE *f, const char *line)
+{
+    if (f != NULL) {
+	fprintf(f, "%s\n", line);
+    } else {
+	syslog(LOG_INFO, "%s", line);
+    }
+}
+
+/* SIGUSR1: histograms and counters to syslog, or the -l file */
+static void dumpLatency(void)
+{
+    char line[256], tmp[256], name[48];
+    FILE *f = NULL;
+    CollectorId id;
+    ProbeId p;
+
+    if (probeFile != NULL) {
+	snprintf(tmp, sizeof(tmp), "%.240s.tmp", probeFile);
+	f = fopen(tmp, "w");
+	if (f == NULL) {
+	    perror(tmp);
+	    return;
+	}
+    } else {
+	openlog("lcd", LOG_PID, LOG_DAEMON);
+    }
+    for (p = 0; p < LASTPROBE; p++) {
+	formatLatency(line, sizeof(line), probeNames[p], &probes[p]);
+	logLatency(f, line);
+    }
+    for (id = 0; id < LASTCOLLECTOR; id++) {
+	Collector *c = &collectors[id];
+	if (c->latency.count > 0) {
+	    /* disk collectors are named by their disk */
+	    snprintf(name, sizeof(name), "collect:%.38s",
+		     id == COLLECT_RESOLVE ? "resolve" : diskNames[id - COLLECT_DISKS]);
+	    formatLatency(line, sizeof(line), name, &c->latency);
+	    logLatency(f, line);
+	}
+    }
+    snprintf(line, sizeof(line), "loops %llu serialbytes %llu forks %llu thermalmissed %llu",
+	     counters.loops, counters.serialBytes, counters.forks,
+	     counters.thermalMissed);
+    logLatency(f, line);
+    if (f == NULL) {
+	closelog();
+    } else if (fclose(f) != 0 || rename(tmp, probeFile) < 0) {
+	perror(probeFile);
+	unlink(tmp);
+    }
+}
+
+static void onUsr1(int sig)
+{
+    probeDump = 1;
+}
+
+static void onDisplayTimer(void)
+{
+    serverStep(TIMEOUT);
+}
+
+static void onHistoryTimer(void)
+{
+    sampleHistory();
+    publishSnapshot();
+    setTimer(TIMER_HISTORY, 1000 - monotonicMs() % 1000);
+}
+
+static void server(int fd)
+{
+    signal(SIGTERM, signalHandler);
+    signal(SIGHUP, signalHandler);
+    signal(SIGINT, signalHandler);
+    signal(SIGQUIT, signalHandler);
+    signal(SIGKILL, signalHandler);
+    signal(SIGSEGV, signalHandler);
+    signal(SIGBUS, signalHandler);
+    signal(SIGUSR1, onUsr1);
+
+    serverfd = fd;
+    display = DATETIME;
+    powerButtonMode = MODE_NONE;
+    darkness = LIGHT;
+    delay = 0;
+    wlan = 1;
+
+    epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollfd < 0) {
+	perror("epoll_create1()");
+	return;
+    }
+    watchFd(fd, EPOLLIN, onLcd);
+    if (trace.mode != TRACE_REPLAY) {
+	initNetlink();
+	ueventfd = initUevent();
+	listenfd = initControl();
+	inotifyfd = initStates();
+	openSnapshot();
+    } else {
+	/* a replay sees nothing but the trace */
+	ueventfd = listenfd = inotifyfd = -1;
+    }
+    scanDisks();
+    initTimer(TIMER_FANS, onFanTimer);
+    initTimer(TIMER_DISPLAY, onDisplayTimer);
+    initTimer(TIMER_EXTADDR, onExtTimer);
+    initTimer(TIMER_JOB, onJobTimer);
+    initTimer(TIMER_HISTORY, onHistoryTimer);
+    initTimer(TIMER_METRICS, onMetricsTimer);
+    setTimer(TIMER_FANS, 0);
+    fanDue = monotonicMs();
+    setTimer(TIMER_DISPLAY, 0);
+    setTimer(TIMER_HISTORY, 0);
+    if (metricsFile != NULL) {
+	/* after the first sample */
+	setTimer(TIMER_METRICS, 1500);
+    }
+
+    runLoop();
+
+    stopCollectors();
+    closeSnapshot();
+    closeHttp();
+    if (job.fd >= 0) {
+	/* a running job is left to finish */
+	close(job.fd);
+    }
+    finishControl(listenfd);
+    if (nlfd >= 0) {
+	close(nlfd);
+    }
+    if (ueventfd >= 0) {
+	close(ueventfd);
+    }
+    if (inotifyfd >= 0) {
+	close(inotifyfd);
+    }
+    close(epollfd);
+    epollfd = -1;
+    if (lcdfd != 0 && termSignal == SIGTERM) {
+	/* user initiated shutdown: powerdown in some seconds */
+	char tmp[sizeof(pwrDownDsp)+12];
+	sprintf(tmp, pwrDownDsp, POWERDOWNWAIT);
+	queueLcd(fd, tmp, strlen(tmp), 0);
+    }
+    writeLcd(fd, "LCD process", "terminated");
+    drainLcd(fd, DRAINWAIT);
+} /* end server */
+ 
+
+static int nif;			/* -i options so far */
+
+/* an option that changes the output, from the command line or the */
+/* header of a trace; NULL or what is wrong with the argument */
+static const char *setOption(int opt, const char *arg)
+{
+    switch (opt) {
+    case 'f':
+	tempunit = FAHRENHEIT;
+	break;
+    case 'a':
+	diskMaxAge = max(atoi(arg), 1);
+	break;
+    case 'A':
+	extMaxAge = max(atoi(arg), 1);
+	break;
+    case 'p':
+	prefetchBudget = max(atoi(arg), 0);
+	break;
+    case 'e':
+	return addEndpoint(arg) ? NULL : "bad endpoint";
+    case 'C':
+	return setCurve(arg) ? NULL : "bad fan curve";
+    case 's':
+	return setStateFile(arg) ? NULL : "bad state file";
+    case 'i':
+	/* the first -i names the interface for line 1, the second for line 2 */
+	lanif[nif++ % 2] = arg;
+	break;
+    }
+    return NULL;
+}
+
+/* lcd replay: the recorded session runs again on the trace's clock */
+
+static int replayPeer = -1;	/* the panel's end of the replayed link */
+static int replayPipes[LASTCOLLECTOR];	/* collectors waiting for their record */
+
+/* the fans are a variable, as in the sim backend; lcd replay */
+/* sets it, -b does not know it */
+static const Backend replayBackend = {
+    "replay", NULL, NULL, NULL, simInitFans, simReadFans, simWriteFans,
+    NULL, NULL, NULL
+};
+
+/* the record at a cursor, 0 at the end or if it is cut short */
+static int nextRecord(TraceCursor *at, TraceRecord *r)
+{
+    unsigned long long delta, len;
+    size_t pos = at->pos;
+    int n;
+
+    if (pos >= trace.len) {
+	return 0;
+    }
+    r->type = trace.buf[pos++];
+    if ((n = getVarint(trace.buf + pos, trace.len - pos, &delta)) == 0) {
+	return 0;
+    }
+    pos += n;
+    if ((n = getVarint(trace.buf + pos, trace.len - pos, &len)) == 0 ||
+	len > trace.len - pos - n) {
+	return 0;
+    }
+    pos += n;
+    r->stamp = at->stamp + delta;
+    r->data = trace.buf + pos;
+    r->len = len;
+    at->pos = pos + len;
+    at->stamp = r->stamp;
+    return 1;
+}
+
+/* a recorded sensor, clock or disk table becomes the current one */
+static void applyRecord(const TraceRecord *r)
+{
+    unsigned long long v;
+    const unsigned char *end;
+    size_t pos;
+    int i;
+
+    switch (r->type) {
+    case TRACE_SENSOR:
+	if (r->len >= 3 && r->data[0] < LASTSENSOR &&
+	    getVarint(r->data + 2, r->len - 2, &v) != 0) {
+	    trace.sensors[r->data[0]].ok = r->data[1];
+	    trace.sensors[r->data[0]].value = (long) (v >> 1) ^ -(long) (v & 1);
+	}
+	break;
+    case TRACE_CLOCK:
+	if (r->len >= 2 && r->data[0] < LASTTRACECLOCK &&
+	    getVarint(r->data + 1, r->len - 1, &v) != 0) {
+	    trace.offset[r->data[0]] = (long long) v - r->stamp;
+	}
+	break;
+    case TRACE_DISKS:
+	/* slot by slot, so the collectors' records still match */
+	for (i = 0, pos = 0; i < MAXDISKS && pos < r->len; i++) {
+	    end = memchr(r->data + pos, 0, r->len - pos);
+	    if (end == NULL) {
 		break;
-#if HMS_PRIVATE
-	    case MODE_WLANOFF:
-		/* toggle wlan by ejecting/inserting the PCMCIA card */
-		if (wlan == 1) {
-		    if (system("cardctl eject 2") == 0)
-			wlan = 0;
+	    }
+	    if (strcmp(diskNames[i], (const char *) r->data + pos) != 0) {
+		if (r->data[pos] != 0) {
+		    initDisk(i, (const char *) r->data + pos);
 		} else {
-		    if (system("cardctl insert 2") == 0)
-			wlan = 1; 
+		    diskNames[i][0] = 0;
 		}
-		powerButtonMode = MODE_NONE;
-		wait = 0;
-		fani = 10;
-		break;
-#endif
-	    case MODE_POWEROFF:
-		/* power off the system */
-		writeLcd(fd, "Shutting", "down system");
-#if !TEST
-		/* we do a shutdown and wait until we are killed */
-		/* the signal handler then will use the LCD stuff */
-		/* to powerdown the system in such a way that the */
-		/* we can switch it on with the power button again */
-	        lcdfd = fd;
-		system("shutdown -h now");
-		/* wait for SIGTERM */
-		sleep(120);
-#endif
+	    }
+	    pos = end - r->data + 1;
+	}
+	break;
+    case TRACE_HISTORY:
+	for (pos = 0; history != NULL && pos < r->len; pos += sizeof(Bucket)) {
+	    if ((i = getVarint(r->data + pos, r->len - pos, &v)) == 0 ||
+		v >= LASTHISTORY * HISTORYSLOTS || r->len - pos - i < sizeof(Bucket)) {
 		break;
-	    default:
-		writeLcd(fd, "Power: Off", "Display: Restart");
-		/* a second button must be pressed within 3 seconds */
-		powerButtonMode = MODE_POWEROFF;
-		wait = 3;
 	    }
-	    break;
+	    pos += i;
+	    memcpy(&history->buckets[0][0] + v, r->data + pos, sizeof(Bucket));
+	}
+	break;
+    default:
+	break;
+    }
+}
 
-	case SELECTBUTTON:
-	    /* display button was pressed */
-	    if (powerButtonMode == MODE_POWEROFF) {
-		/* reboot the system */
-		writeLcd(fd, "Restarting", "system");
-#if !TEST
-		system("shutdown -r now");
-		/* wait for SIGTERM */
-		sleep(120);
-#endif
-		break;
+/* compare what the server wrote with what it wrote when recorded */
+static void replayOutput(void)
+{
+    unsigned char buf[256];
+    int i, res;
+
+    while ((res = read(replayPeer, buf, sizeof(buf))) > 0) {
+	for (i = 0; i < res && trace.diverged < 0; i++) {
+	    if (trace.outPos < trace.outLen && trace.out[trace.outPos] == buf[i]) {
+		trace.outPos++;
+	    } else {
+		trace.diverged = trace.now;
 	    }
-	    /* switch to next display */
-	    display++;
-	    fani = 0;
-	    /* fall through */
+	}
+    }
+}
 
-	case TIMEOUT:
-	    /* timeout */
-	    /* cancel power down cycle */
-	    powerButtonMode = MODE_NONE;
-	    switch (display) {
-	    case TEMPS:
-	      {
-		/* write temperatures */
-	        int cputemp = readSysTemp(CPUTEMPINP);
-		int systemp = readSysTemp(SYSTEMPINP); 
-		if (tempunit == FAHRENHEIT) {
-		  cputemp = ((float)cputemp * 1.8) + 32;
-		  systemp = ((float)systemp * 1.8) + 32;
-		}
-		sprintf(tmp2, "CPU %d, Sys %d", cputemp, systemp);
-		writeLcd(fd, "Temperature", tmp2);
-		wait = fanControl == ALWAYSON? 60 : 10;
-		break;
-	      }
-
-	    case FANS:
-		/* write fan revolutions */
-		sprintf(tmp1, "CPU fan %4d",
-			atoi(readSys(CPUFANINP))); 
-		sprintf(tmp2, "Sys fan %4d",
-			atoi(readSys(SYSFANINP))); 
-		writeLcd(fd, tmp1, tmp2);
-		wait = fanControl == ALWAYSON? 120 : 10;
-		break;
+/* move the clock to the next record or to the deadline, whichever */
+/* is first, taking in the records on the way; a button press or a */
+/* collector's result reaches the server at its time. Returns the */
+/* epoll timeout. */
+static int replayWait(int timeout)
+{
+    long long until = timeout < 0 ? LLONG_MAX : trace.now + timeout * 1000LL;
+    TraceCursor at;
+    TraceRecord r;
 
-	    case FANCTL:
-		/* offer fan control setting */
-		if (fanControl == UNAVAILABLE) {
-		    display++;
-		    /* fall through */
-		} else {
-		    powerButtonMode = MODE_FANOFF;
-		    wait = 2;
-		    if ((fani++ % 2) == 0) {
-			writeLcd(fd, "Fans are", 
-				 fanControl == CONTROLLED? 
-				 "controlled" : "always on");
-		        if (fani > 10) {
-			    /* we have seen it five times - that's enough */
-			    fani = 0;
-			    display = FANS;
-			    wait = 5;
-			}
-		    } else {
-			writeLcd(fd, "Power button", "to toggle");
-		    }
-		    break;
-		}
+    replayOutput();
+    for (;;) {
+	at = trace.at;
+	if (!nextRecord(&at, &r)) {
+	    /* the trace is over, and so is the session */
+	    terminating = 1;
+	    return 0;
+	}
+	if (r.stamp > until) {
+	    trace.now = until;
+	    return 0;
+	}
+	trace.at = at;
+	trace.now = max(trace.now, r.stamp);
+	applyRecord(&r);
+	if (r.type == TRACE_LOOKUP && ext.state == EXT_IDLE) {
+	    /* the server asked where we did not */
+	    ext.tries = 0;
+	    ext.state = EXT_CONNECT;
+	} else if (r.type == TRACE_ADDRESS && r.len == 0) {
+	    extGiveUp();
+	} else if (r.type == TRACE_ADDRESS && r.len < sizeof(ext.addr)) {
+	    memcpy(ext.addr, r.data, r.len);
+	    ext.addr[r.len] = 0;
+	    extFound();
+	} else if (r.type == TRACE_IN) {
+	    write(replayPeer, r.data, r.len);
+	    return 0;
+	} else if (r.type == TRACE_COLLECT && r.len >= 1 &&
+		   r.data[0] < LASTCOLLECTOR && replayPipes[r.data[0]] >= 0) {
+	    /* the collector ends now, the event loop takes it in */
+	    /* before later records */
+	    write(replayPipes[r.data[0]], r.data + 1, r.len - 1);
+	    close(replayPipes[r.data[0]]);
+	    replayPipes[r.data[0]] = -1;
+	    return 0;
+	}
+    }
+}
 
-	    case DISKTEMPS:
-		/* write harddisk temperature - changed hda & hdb TO sda/sdb for Ubuntu 8.04LTS */
-		writeLcd(fd, "Disk temperature", "waiting ...");
-		f = popen("smartctl /dev/sda -A|grep 194|awk '{print $10}'", "r");
-		n = fread(tmp1, 1, sizeof(tmp1), f);
-		pclose(f);
-		if (n > 0) {
-		  int temp = atoi(tmp1);
-		  if (tempunit == FAHRENHEIT) {
-		      temp = ((float)temp * 1.8) + 32;
-		  }
-		  sprintf(tmp2, "sda %d", temp);
-		  f = popen("smartctl /dev/sdb -A|grep 194|awk '{print $10}'", "r");
-		    n = fread(tmp1, 1, sizeof(tmp1), f);
-		    pclose(f);
-		    if (n > 0) {
-			/* append data for second disk */
-		        temp = atoi(tmp1);
-		        if (tempunit == FAHRENHEIT) {
-			  temp = ((float)temp * 1.8) + 32;
-			}
-			sprintf(tmp2+strlen(tmp2), ", sdb %d", temp);
-		    }
-		    writeLcd(fd, "Disk temperature", tmp2);
-		} else {
-		    writeLcd(fd, "Disk temperature", "unknown");
-		}
-		wait = 300;	/* every 5 minutes only */    
-		break;
+/* the collector's next recorded result is written by replayWait */
+/* when the trace gets there, 1 if it keeps fd for that; without */
+/* one ahead its last one is written now */
+static int replayCollector(Collector *c, int fd)
+{
+    TraceCursor at = trace.at;
+    TraceRecord r, found;
+    int id = c - collectors, have = 0;
 
-	    case EXTADDR:
-		/* write external address */
-		writeLcd(fd, "External IP Addr", "waiting ...");
-		f = popen("curl -s -m 10 http://whatismyip.org/", "r");
-		n = fread(tmp1, 1, sizeof(tmp1), f);
-		pclose(f);
-		if (n > 0) {
-		    tmp1[n] = 0;
-		    writeLcd(fd, "External IP Addr", tmp1);
-		    wait = 60*5; /* every 5 minutes */
-		} else {
-		    writeLcd(fd, "External IP Addr", "None");
-		    wait = 10; /* every 10 seconds */
-		}
-		break;
+    while (!have && nextRecord(&at, &r)) {
+	have = r.type == TRACE_COLLECT && r.len >= 1 && r.data[0] == id;
+    }
+    if (have) {
+	replayPipes[id] = fd;
+	return 1;
+    }
+    at.pos = trace.first;
+    memcpy(&at.stamp, trace.buf + 8, sizeof(at.stamp));
+    while (at.pos < trace.at.pos && nextRecord(&at, &found)) {
+	if (found.type == TRACE_COLLECT && found.len >= 1 && found.data[0] == id) {
+	    r = found;
+	    have = 1;
+	}
+    }
+    if (have && r.len > 1) {
+	write(fd, r.data + 1, r.len - 1);
+    }
+    return 0;
+}
 
-	    case LANADDR:
-		/* show LAN (internal) address */
-		wait = 60*5; /* every 5 minutes */
-		f = popen(ETH0, "r");
-		n = fread(tmp1, 1, sizeof(tmp1), f);
-		pclose(f);
-		if (n > 0) {
-		    tmp1[n] = 0;
-		} else {
-		    strcpy(tmp1, "eth0 ???");
-		    wait = 10; /* bump test up to every 10 seconds */
-		}
-		f = popen(ETH1, "r");
-		n = fread(tmp2, 1, sizeof(tmp2), f);
-		pclose(f);
-		if (n > 0) {
-		    tmp2[n] = 0;
-		} else {
-		    strcpy(tmp2, "eth1 ???");
-		    wait = 10; /* bump test up to every 10 seconds */
-		}
-		writeLcd(fd, tmp1, tmp2);
-		break;
+/* read a whole trace to replay, 0 if it is none */
+static int loadTrace(const char *pathname)
+{
+    struct stat st;
+    unsigned long long len;
+    int fd, n;
 
-	    case UPTIME:
-		/* write system uptime */
-		sysinfo(&info);
-		updays = (int) info.uptime / (60*60*24);
-		upminutes = (int) info.uptime / 60;
-		uphours = (upminutes / 60) % 24;
-		upminutes %= 60;
-		sprintf(tmp1, "%d day%s, %02d:%02d", updays, 
-			(updays != 1) ? "s" : "", 
-			uphours, upminutes);
-		writeLcd(fd, "Uptime", tmp1);
-		wait = 60*5; /* every 5 minutes */
-		break;
+    fd = open(pathname, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+	perror(pathname);
+	return 0;
+    }
+    trace.buf = malloc(st.st_size + 1);
+    trace.out = malloc(st.st_size + 1);
+    if (trace.buf == NULL || trace.out == NULL ||
+	read(fd, trace.buf, st.st_size) != st.st_size) {
+	perror(pathname);
+	close(fd);
+	return 0;
+    }
+    close(fd);
+    trace.len = st.st_size;
+    if (trace.len < 16 || memcmp(trace.buf, TRACEMAGIC, 8) != 0 ||
+	(n = getVarint(trace.buf + 16, trace.len - 16, &len)) == 0 ||
+	len > trace.len - 16 - n || len > sizeof(trace.options)) {
+	fprintf(stderr, "%s: not a trace\n", pathname);
+	return 0;
+    }
+    memcpy(trace.options, trace.buf + 16 + n, len);
+    trace.optionsLen = len;
+    trace.first = trace.at.pos = 16 + n + len;
+    memcpy(&trace.at.stamp, trace.buf + 8, sizeof(trace.at.stamp));
+    trace.now = trace.at.stamp;
+    trace.mode = TRACE_REPLAY;
+    return 1;
+}
 
-	    case FIREWALLCTL:
-		/* offer Firewall control setting */
-		firewall = firewall_is_on();
-		powerButtonMode = MODE_FIREWALL;
-		wait = 2;
-		if ((fani++ % 2) == 0) {
-		    writeLcd(fd, "Firewall is", 
-			     firewall? "enabled": "disabled");
-		    if (fani > 10) {
-			/* we have seen it five times - that's enough */
-			fani = 0;
-			display = DATETIME;
-			wait = 5;
-		    }
-		} else {
-		    writeLcd(fd, "Power button to", 
-			     firewall? "turn OFF": "turn ON");
-		}
-		break;
+/* take in the first state of everything and put the recorded */
+/* output together; returns the number of records */
+static int firstStates(void)
+{
+    int sensorSeen[LASTSENSOR] = {0}, clockSeen[LASTTRACECLOCK] = {0};
+    int n = 0, disksSeen = 0, historySeen = 0;
+    TraceCursor at = trace.at;
+    TraceRecord r;
 
-#if HMS_PRIVATE		
-	    case WLANCTL:
-		/* offer WLAN control setting */
-		powerButtonMode = MODE_WLANOFF;
-		wait = 2;
-		if ((fani++ % 2) == 0) {
-		    writeLcd(fd, "Wireless LAN is", 
-			     wlan? "enabled": "disabled");
-		    if (fani > 10) {
-			/* we have seen it five times - that's enough */
-			fani = 0;
-			display = DATETIME;
-			wait = 5;
-		    }
-		} else {
-		    writeLcd(fd, "Power button to", 
-			     wlan? "disable WLAN": "enable WLAN");
-		}
-		break;
-#endif
+    while (nextRecord(&at, &r)) {
+	n++;
+	if (r.type == TRACE_OUT) {
+	    memcpy(trace.out + trace.outLen, r.data, r.len);
+	    trace.outLen += r.len;
+	} else if ((r.type == TRACE_SENSOR && r.len > 0 && r.data[0] < LASTSENSOR &&
+		    !sensorSeen[r.data[0]]++) ||
+		   (r.type == TRACE_CLOCK && r.len > 0 && r.data[0] < LASTTRACECLOCK &&
+		    !clockSeen[r.data[0]]++) ||
+		   (r.type == TRACE_DISKS && !disksSeen++) ||
+		   (r.type == TRACE_HISTORY && !historySeen++)) {
+	    applyRecord(&r);
+	}
+    }
+    return n;
+}
 
-	    case DATETIME:
-	    default:
-		/* write date and time */
-		strftime(tmp1, sizeof(tmp1), "%a %d-%b-%Y ", tm);
-		strftime(tmp2, sizeof(tmp2), TIMEFORMAT, tm);
-		writeLcd(fd, tmp1, tmp2);
-		if (darkness == DARK) {
-		    /* wait until 07:00 */
-		    wait = 3600 * (DARKUNTIL - tm->tm_hour)
-			- tm->tm_min * 60 - tm->tm_sec; 
-		} else {
-		    /* wait a minute */
-		    wait = 60;	
-		}
-		/* restart display cycle */
-		display = DATETIME;
-		break;
-		    
-	    }
-	    break;	
-	} 	
-	if (darkness == WANTSDARK) {
-	    /* switch off display in two seconds  */
-	    wait = 10;
+static long long realUs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* replay a trace, 1 if the server wrote what it wrote when recorded */
+static int replay(const char *pathname)
+{
+    long long start = realUs(), took, first;
+    int sv[2], records, i;
+    const char *error;
+    size_t pos;
+
+    if (!loadTrace(pathname)) {
+	return 0;
+    }
+    /* the options the session ran with */
+    nendpoints = 0;
+    nif = 0;
+    for (pos = 0; pos < trace.optionsLen; pos += strlen(trace.options + pos) + 1) {
+	if ((error = setOption(trace.options[pos], trace.options + pos + 1)) != NULL) {
+	    fprintf(stderr, "%s: %s %s\n", pathname, error, trace.options + pos + 1);
+	    return 0;
 	}
-#if DEB
-	fprintf(stderr, "darkness=%d, wait=%d\n", darkness, wait);
-#endif 
     }
-    writeLcd(fd, "LCD process", "terminated");
-} /* end server */
- 
+    addDefaultEndpoints();
+    openHistory();
+    records = firstStates();
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, sv) < 0) {
+	perror("socketpair()");
+	return 0;
+    }
+    first = trace.now;
+    replayPeer = sv[1];
+    for (i = 0; i < LASTCOLLECTOR; i++) {
+	replayPipes[i] = -1;
+    }
+    backend = &replayBackend;
+    initFanControl(1);
+    server(sv[0]);
+    replayOutput();
+    for (i = 0; i < LASTCOLLECTOR; i++) {
+	if (replayPipes[i] >= 0) {
+	    close(replayPipes[i]);
+	}
+    }
+    closeHistory();
+    close(sv[0]);
+    close(sv[1]);
+    took = max(realUs() - start, 1);
+
+    printf("%d records, %.3f s recorded, replayed in %.3f s, %.0fx real time\n",
+	   records, (trace.now - first) / 1e6, took / 1e6,
+	   (double) (trace.now - first) / took);
+    if (trace.diverged >= 0) {
+	printf("output differs from byte %zu, %.3f s into the trace\n",
+	       trace.outPos, (trace.diverged - first) / 1e6);
+    } else if (trace.outPos < trace.outLen) {
+	printf("output stops after %zu of %zu bytes\n", trace.outPos, trace.outLen);
+    } else {
+	printf("output as recorded, %zu bytes\n", trace.outLen);
+    }
+    return trace.diverged < 0 && trace.outPos == trace.outLen;
+}
 	
+/* lcd bench: every page is collected and drawn runs times from cold */
+/* caches, through the same event loop as the server, and we report */
+/* what one refresh costs */
+
+#define BENCHRUNS 20
+#define BENCHWAIT ((HTTPTIMEOUT + 1) * 1000)	/* ms a refresh may take */
+
+typedef struct {
+    long long us;		/* wall time */
+    long long cpuUs;		/* user and system, ours and the children's */
+    unsigned long long forks;
+    unsigned long long bytes;
+    long long rwCalls;		/* read and write calls, -1 if unknown */
+} BenchSample;
+
+static long long cpuUs(void)
+{
+    struct rusage self, children;
+
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+    return (self.ru_utime.tv_sec + self.ru_stime.tv_sec +
+	    children.ru_utime.tv_sec + children.ru_stime.tv_sec) * 1000000LL +
+	self.ru_utime.tv_usec + self.ru_stime.tv_usec +
+	children.ru_utime.tv_usec + children.ru_stime.tv_usec;
+}
+
+/* read and write system calls so far, from /proc/self/io; */
+/* other system calls are not counted there */
+static long long rwCallCount(void)
+{
+    char buf[512], *p;
+    long long n = 0;
+    int fd, len;
+
+    fd = open("/proc/self/io", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+	return -1;
+    }
+    len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0) {
+	return -1;
+    }
+    buf[len] = 0;
+    if ((p = strstr(buf, "syscr: ")) != NULL) {
+	n += atoll(p + 7);
+    }
+    if ((p = strstr(buf, "syscw: ")) != NULL) {
+	n += atoll(p + 7);
+    }
+    return n;
+}
+
+static void benchSample(BenchSample *b)
+{
+    b->us = nowUs();
+    b->cpuUs = cpuUs();
+    b->forks = counters.forks;
+    b->bytes = counters.serialBytes;
+    b->rwCalls = rwCallCount();
+}
+
+/* something of the refresh is still under way */
+static int benchBusy(void)
+{
+    CollectorId id;
+
+    for (id = 0; id < LASTCOLLECTOR; id++) {
+	if (collectors[id].pid != 0) {
+	    return 1;
+	}
+    }
+    return ext.state != EXT_IDLE || outHead < outTail;
+}
+
+static int compareLong(const void *a, const void *b)
+{
+    long long x = *(const long long *) a, y = *(const long long *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void benchPage(int fd, Display page, int runs, int tsv)
+{
+    BenchSample before, after;
+    long long *us = calloc(runs, sizeof(long long));
+    long long cpu = 0, rwCalls = 0, deadline;
+    unsigned long long forks = 0, bytes = 0;
+    char buf[256];
+    CollectorId id;
+    int i;
+
+    if (us == NULL) {
+	return;
+    }
+    for (i = 0; i < runs && !terminating; i++) {
+	/* cold caches, so every run collects and draws */
+	for (id = 0; id < LASTCOLLECTOR; id++) {
+	    collectors[id].ready = 0;
+	}
+	ext.addr[0] = 0;
+	ext.retryAt = 0;
+	shadowValid = 0;
+	display = page;
+	fani = 0;
+	powerButtonMode = MODE_NONE;
+
+	benchSample(&before);
+	serverStep(REFRESH);
+	deadline = monotonicMs() + BENCHWAIT;
+	while (benchBusy() && monotonicMs() < deadline && !terminating) {
+	    runOnce(100);
+	    /* only the refresh we started counts */
+	    setTimer(TIMER_DISPLAY, -1);
+	}
+	benchSample(&after);
+
+	us[i] = after.us - before.us;
+	cpu += after.cpuUs - before.cpuUs;
+	forks += after.forks - before.forks;
+	bytes += after.bytes - before.bytes;
+	rwCalls = before.rwCalls < 0 || rwCalls < 0 ? -1 :
+	    rwCalls + after.rwCalls - before.rwCalls;
+	/* nobody reads the simulated panel, so we do */
+	while (simSlave >= 0 && read(simSlave, buf, sizeof(buf)) > 0)
+	    ;
+    }
+    runs = i;
+    if (runs == 0) {
+	free(us);
+	return;
+    }
+    qsort(us, runs, sizeof(long long), compareLong);
+    if (tsv) {
+	printf("%s\t%d\t%lld\t%lld\t%.2f\t%.1f\t%.1f\t%lld\n",
+	       pageNames[page], runs, us[(runs - 1) / 2], us[(runs * 99 - 1) / 100],
+	       (double) forks / runs, (double) bytes / runs,
+	       rwCalls < 0 ? -1.0 : (double) rwCalls / runs, cpu / runs);
+    } else {
+	printf("%-10s %5d %9.2f %9.2f %6.2f %6.1f %9.1f %8.2f\n",
+	       pageNames[page], runs, us[(runs - 1) / 2] / 1000.0,
+	       us[(runs * 99 - 1) / 100] / 1000.0,
+	       (double) forks / runs, (double) bytes / runs,
+	       rwCalls < 0 ? -1.0 : (double) rwCalls / runs,
+	       cpu / runs / 1000.0);
+    }
+    fflush(stdout);
+    free(us);
+}
+
+static void bench(int fd, int runs, int tsv)
+{
+    Display page;
+
+    signal(SIGINT, signalHandler);
+    signal(SIGTERM, signalHandler);
+    serverfd = fd;
+    darkness = LIGHT;
+    wlan = 1;
+    epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollfd < 0) {
+	perror("epoll_create1()");
+	return;
+    }
+    watchFd(fd, EPOLLIN, onLcd);
+    initNetlink();
+    scanDisks();
+    initTimer(TIMER_DISPLAY, onDisplayTimer);
+    initTimer(TIMER_EXTADDR, onExtTimer);
+    initTimer(TIMER_JOB, onJobTimer);
+    /* let netlink fill the interface table first */
+    runOnce(100);
+
+    if (tsv) {
+	printf("page\truns\tp50_us\tp99_us\tforks\tbytes\trw_calls\tcpu_us\n");
+    } else {
+	printf("%-10s %5s %9s %9s %6s %6s %9s %8s\n", "page", "runs",
+	       "p50 ms", "p99 ms", "forks", "bytes", "rw calls", "cpu ms");
+    }
+    for (page = DATETIME; page < LASTDISPLAY && !terminating; page++) {
+	benchPage(fd, page, runs, tsv);
+    }
+
+    stopCollectors();
+    closeHttp();
+    if (nlfd >= 0) {
+	close(nlfd);
+    }
+    close(epollfd);
+    epollfd = -1;
+}
+
 static void usage(int argc, char **argv)
 {
     fprintf(stderr,
-	    "Usage: %s [-f] <command> [...] \n"
-	    "<command> can be server, write, read, fans\n"
+	    "Usage: %s [-f] [-i interface] [-a seconds] [-p runs] [-e url]\n"
+	    "       [-A seconds] [-s state=file] [-t file] [-m file] [-M seconds]\n"
+	    "       [-l file] [-r file] [-C fan=temp:duty,...]\n"
+	    "       [-b backend] [-c socket] <command> [...] \n"
+	    "<command> can be server, write, stream, read, sensor, page, dump, bench,\n"
+	    "             replay, fans\n"
 	    "   server    run in server mode taking over LCD, buttons and fans\n"
 	    "   write     writes next two parameters to display\n"
+	    "   stream    writes pairs of lines from stdin to display\n"
 	    "   read      reads LCD buttons with optional timeout\n"
+	    "   sensor    prints cputemp, systemp, cpufan, sysfan or a disk's temperature\n"
+	    "   page      shows a page: datetime, temps, temptrend, fans, fantrend,\n"
+	    "             fanctl, disks, extaddr, lanaddr, uptime, firewall or wlan\n"
+	    "   dump      prints the server's latest readings from " LCDSHMFILE "\n"
+	    "   bench     times each page [runs, default 20] [tsv for tab separated]\n"
+	    "   replay    runs the server again on a trace recorded with -r\n"
 	    "   fans      turn fans on or off\n"
-	    "Use the -f option to display temperatures in Fahrenheit. \n",
+	    "Use the -f option to display temperatures in Fahrenheit. \n"
+	    "Use -i up to twice to choose the interfaces on the LAN address page.\n"
+	    "Use -a to set how many seconds a disk temperature is reused.\n"
+	    "Use -p to set how many times an hour the next page may be\n"
+	    "collected in advance, 0 turns it off.\n"
+	    "Use -e up to four times to ask other http:// endpoints for the\n"
+	    "external address, and -A to set how many seconds it is kept.\n"
+	    "Use -s firewall=file to change the file whose existence means\n"
+	    "the firewall is on.\n"
+	    "Use -t to keep the sensor history in another file than\n"
+	    HISTORYFILE ".\n"
+	    "Use -m to write Prometheus metrics to a file for the node_exporter\n"
+	    "textfile collector, every 15 seconds or every -M seconds.\n"
+	    "On SIGUSR1 the server logs its latency histograms to syslog,\n"
+	    "or writes them to the -l file.\n"
+	    "Use -r to record the server's panel traffic, sensors and clock\n"
+	    "to a trace for lcd replay.\n"
+	    "Fans with a hwmon pwm channel are driven by a PI controller on\n"
+	    "top of a curve; -C cpu=40:64,60:255 or -C sys=... sets the\n"
+	    "curve as temperature:duty points, duty 0 to 255.\n"
+	    "Use -b sim or -b sim:dir to run without the SG30: the panel is\n"
+	    "a pty linked as dir/panel (default " SIMDIR "), the sensors\n"
+	    "a made up hwmon tree in dir/hwmon and the fans a variable.\n"
+	    "write, read, sensor and page talk to a running server through\n"
+	    "the control socket " CONTROLSOCKET " (-c changes it).\n",
 	    argv[0]);
 } /* end usage */
 
 
-int main(int argc, char **argv)	
+static int openLcd(struct termios *oldtio)
 {
     int fd;
-    int n = 1;
-    struct termios oldtio, newtio;
+    struct termios newtio;
 
-#if DEB
-    fprintf(stderr, "Starting version %s...\n", VERSION);
-#endif
-    fd = open(LCDDEVICE, O_RDWR | O_NOCTTY ); 
+    fd = backend->openLcd();
     if (fd < 0) {
-	perror(LCDDEVICE); 
 	exit(EXIT_FAILURE); 
     }
 #if DEB
-    fprintf(stderr, "opened %s\n", LCDDEVICE);
+    fprintf(stderr, "opened the %s panel\n", backend->name);
 #endif
  
     /* save current port settings */
-    tcgetattr(fd, &oldtio);
+    tcgetattr(fd, oldtio);
 
     bzero(&newtio, sizeof(newtio));
     newtio.c_cflag = BAUDRATE | CS8 | CSTOPB | PARENB | CREAD;
@@ -821,41 +5512,303 @@ int main(int argc, char **argv)
 
     tcflush(fd, TCIFLUSH);
     tcsetattr(fd, TCSANOW, &newtio);
+    return fd;
+}
 
-    if (argc < 2) {
-	usage(argc, argv);
-	exit(EXIT_SUCCESS);
+static void closeLcd(int fd, struct termios *oldtio)
+{
+    drainLcd(fd, DRAINWAIT);
+
+    /* restore 	modem settings */
+    tcsetattr(fd, TCSANOW, oldtio);
+    backend->closeLcd(fd);
+}
+
+/* lcd stream: show frames read from stdin, two lines each, or one line */
+/* with a tab between the halves; frames that come faster than 9600 baud */
+/* can carry are coalesced so only the latest one is shown */
+
+#define STREAMINTERVAL ((2 * LINELEN + 4) * 12 * 1000 / 9600)	/* ms per frame, 8E2 */
+
+static void streamLcd(void)
+{
+    struct termios oldtio;
+    struct pollfd pfd[2];
+    char in[512], frame[2][LINELEN + 1], half[LINELEN + 1], buf[64];
+    char command[2 * LINELEN + 16];
+    int fd, serverfd, len = 0, res, i, pending = 0, halfSet = 0, eof = 0;
+    long long next = 0;
+
+    /* a running server draws the frames, else we do it ourselves */
+    serverfd = connectServer();
+    fd = serverfd >= 0 ? serverfd : openLcd(&oldtio);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    while (!eof || pending) {
+	pfd[0].fd = eof ? -1 : STDIN_FILENO;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = fd;
+	pfd[1].events = serverfd >= 0 ? POLLIN : (outHead < outTail ? POLLOUT : 0);
+	res = poll(pfd, 2, pending ? max(next - monotonicMs(), 0) : -1);
+	if (res < 0 && errno != EINTR) {
+	    break;
+	}
+	if (pfd[1].revents & POLLIN) {
+	    /* the server's "ok"s are of no interest */
+	    if (read(fd, buf, sizeof(buf)) <= 0) {
+		break;
+	    }
+	}
+	if (pfd[1].revents & POLLOUT) {
+	    flushLcd(fd);
+	}
+	if (pfd[0].revents & (POLLIN | POLLHUP)) {
+	    res = read(STDIN_FILENO, in + len, sizeof(in) - 1 - len);
+	    if (res <= 0) {
+		eof = 1;
+	    } else {
+		len += res;
+	    }
+	    in[len] = 0;
+	    for (i = 0; (res = strcspn(in + i, "\n")) + i < len; i += res + 1) {
+		char *line = in + i, *tab, *p;
+		line[res] = 0;
+		/* the first tab splits the frame, other controls must */
+		/* not get to the server or the panel */
+		tab = strchr(line, '\t');
+		for (p = line; *p != 0; p++) {
+		    if (p != tab && iscntrl((unsigned char) *p)) {
+			*p = ' ';
+		    }
+		}
+		if (tab != NULL) {
+		    *tab = 0;
+		    snprintf(frame[0], sizeof(frame[0]), "%s", line);
+		    snprintf(frame[1], sizeof(frame[1]), "%s", tab + 1);
+		    pending = 1;
+		} else if (!halfSet) {
+		    snprintf(half, sizeof(half), "%s", line);
+		    halfSet = 1;
+		} else {
+		    /* a newer frame simply replaces one not yet shown */
+		    snprintf(frame[0], sizeof(frame[0]), "%s", half);
+		    snprintf(frame[1], sizeof(frame[1]), "%s", line);
+		    halfSet = 0;
+		    pending = 1;
+		}
+	    }
+	    len -= i;
+	    memmove(in, in + i, len);
+	    if (len == sizeof(in) - 1) {
+		/* a line longer than we care about */
+		len = 0;
+	    }
+	}
+	if (pending && monotonicMs() >= next) {
+	    if (serverfd >= 0) {
+		snprintf(command, sizeof(command), "write %s\t%s\n", frame[0], frame[1]);
+		write(fd, command, strlen(command));
+	    } else {
+		writeLcd(fd, frame[0], frame[1]);
+	    }
+	    pending = 0;
+	    next = monotonicMs() + STREAMINTERVAL;
+	}
+    }
+    if (serverfd >= 0) {
+	close(serverfd);
+    } else {
+	closeLcd(fd, &oldtio);
     }
+}
+
+int main(int argc, char **argv)
+{
+    int fd, n, opt;
+    struct termios oldtio;
+    char response[64], command[2 * LINELEN + 16];
+    const char *error;
 
-    if (strcmp(argv[1], "-f") == 0) {
-      tempunit = FAHRENHEIT;
-      n = 2;
+#if DEB
+    fprintf(stderr, "Starting version %s...\n", VERSION);
+#endif
+    diskMaxAge = DISKMAXAGE;
+    extMaxAge = EXTADDRAGE;
+    prefetchBudget = PREFETCHBUDGET;
+    while ((opt = getopt(argc, argv, "+fi:a:A:b:c:p:e:s:t:m:M:l:r:C:")) != -1) {
+	switch (opt) {
+	case 'b':
+	    if (!setBackend(optarg)) {
+		fprintf(stderr, "%s: unknown backend %s\n", argv[0], optarg);
+		exit(EXIT_FAILURE);
+	    }
+	    break;
+	case 'c':
+	    controlSocket = optarg;
+	    break;
+	case 't':
+	    historyFile = optarg;
+	    break;
+	case 'm':
+	    metricsFile = optarg;
+	    break;
+	case 'l':
+	    probeFile = optarg;
+	    break;
+	case 'r':
+	    recordFile = optarg;
+	    break;
+	case 'M':
+	    metricsInterval = max(atoi(optarg), 1);
+	    break;
+	case 'f':
+	case 'a':
+	case 'A':
+	case 'p':
+	case 'e':
+	case 'C':
+	case 's':
+	case 'i':
+	    if ((error = setOption(opt, optarg)) != NULL) {
+		fprintf(stderr, "%s: %s %s\n", argv[0], error, optarg);
+		exit(EXIT_FAILURE);
+	    }
+	    keepOption(opt, optarg != NULL ? optarg : "");
+	    break;
+	default:
+	    usage(argc, argv);
+	    exit(EXIT_FAILURE);
+	}
+    }
+    addDefaultEndpoints();
+    if (!backend->init()) {
+	exit(EXIT_FAILURE);
+    }
+    if (controlSocket == NULL) {
+	controlSocket = backend->controlSocket != NULL ?
+	    backend->controlSocket : CONTROLSOCKET;
+    }
+    if (historyFile == NULL) {
+	historyFile = backend->history != NULL ? backend->history : HISTORYFILE;
+    }
+    if (stateFiles[STATE_FIREWALL].path == NULL) {
+	stateFiles[STATE_FIREWALL].path = backend->firewall != NULL ?
+	    backend->firewall : FIREWALLSTATUSFILE;
+    }
+    if (backend->snapshot != NULL) {
+	snapshotFile = backend->snapshot;
+    }
+    n = optind;
+    if (n >= argc) {
+	usage(argc, argv);
+	exit(EXIT_SUCCESS);
     }
 
     if (strcmp(argv[n], "server") == 0) {
-	initFanControl();
+	if ((fd = connectServer()) >= 0) {
+	    /* two servers would fight over the panel */
+	    fprintf(stderr, "%s: a server is running on %s\n", argv[0], controlSocket);
+	    exit(EXIT_FAILURE);
+	}
+	if (recordFile != NULL && !openTrace(recordFile)) {
+	    exit(EXIT_FAILURE);
+	}
+	fd = openLcd(&oldtio);
+	discoverSensors();
+	initFanControl(1);
+	openHistory();
+#ifdef GLYPHDSP
+	defineGlyphs(fd);
+#endif
 	server(fd);
+	closeHistory();
 	finishFanControl(FANON);
+	closeLcd(fd, &oldtio);
+	closeTrace();
     } else if (strcmp(argv[n], "write") == 0) {
-	writeLcd(fd, argv[n+1], argv[3]);
+	if ((n+1 < argc && hasControl(argv[n+1])) ||
+	    (n+2 < argc && hasControl(argv[n+2]))) {
+	    fprintf(stderr, "%s: control character in the message\n", argv[0]);
+	    exit(EXIT_FAILURE);
+	}
+	snprintf(command, sizeof(command), "write %.*s\t%.*s\n",
+		 LINELEN, n+1 < argc ? argv[n+1] : "",
+		 LINELEN, n+2 < argc ? argv[n+2] : "");
+	if (request(command, response, sizeof(response)) < 0) {
+	    /* no server, write to the LCD ourselves */
+	    fd = openLcd(&oldtio);
+	    writeLcd(fd, n+1 < argc ? argv[n+1] : NULL, n+2 < argc ? argv[n+2] : NULL);
+	    closeLcd(fd, &oldtio);
+	}
     } else if (strcmp(argv[n], "read") == 0) {
 	int wait = -1;
 	char *answer = "Timeout";
+	char event[16];
 	Button b;
 
-	if (argc >= 3) {
+	if (n+1 < argc) {
 	    wait = atoi(argv[n+1]);
 	}
-	b = readButton(fd, wait);
-	if (b == POWERBUTTON) {
-	    answer = "power";
-	} else if (b == SELECTBUTTON) {
-	    answer = "display";
+	fd = connectServer();
+	if (fd >= 0) {
+	    /* the server tells us about presses, after its "ok" */
+	    write(fd, "subscribe\n", 10);
+	    if (readReply(fd, event, sizeof(event), 5) &&
+		readReply(fd, event, sizeof(event), wait)) {
+		answer = strcmp(event, "power") == 0 ? "power" : "display";
+	    }
+	    close(fd);
+	} else {
+	    fd = openLcd(&oldtio);
+	    b = readButton(fd, wait);
+	    if (b == POWERBUTTON) {
+		answer = "power";
+	    } else if (b == SELECTBUTTON) {
+		answer = "display";
+	    }
+	    closeLcd(fd, &oldtio);
 	}
 	printf("%s\n", answer);
+    } else if (strcmp(argv[n], "replay") == 0 && n+1 < argc) {
+	if (!replay(argv[n+1])) {
+	    exit(EXIT_FAILURE);
+	}
+    } else if (strcmp(argv[n], "bench") == 0) {
+	if ((fd = connectServer()) >= 0) {
+	    /* the server would fight us for the panel */
+	    fprintf(stderr, "%s: a server is running on %s, stop it first\n",
+		    argv[0], controlSocket);
+	    exit(EXIT_FAILURE);
+	}
+	fd = openLcd(&oldtio);
+	discoverSensors();
+	initFanControl(0);
+	bench(fd, n+1 < argc ? max(atoi(argv[n+1]), 1) : BENCHRUNS,
+	      n+2 < argc && strcmp(argv[n+2], "tsv") == 0);
+	closeLcd(fd, &oldtio);
+    } else if (strcmp(argv[n], "stream") == 0) {
+	streamLcd();
+    } else if ((strcmp(argv[n], "sensor") == 0 || strcmp(argv[n], "page") == 0) &&
+	       n+1 < argc) {
+	snprintf(command, sizeof(command), "%s %.16s\n", argv[n], argv[n+1]);
+	if (request(command, response, sizeof(response)) < 0) {
+	    fprintf(stderr, "%s: no server running\n", argv[0]);
+	    exit(EXIT_FAILURE);
+	}
+	printf("%s\n", response);
+	if (strncmp(response, "error", 5) == 0) {
+	    exit(EXIT_FAILURE);
+	}
+    } else if (strcmp(argv[n], "dump") == 0) {
+	if (!dumpSnapshot()) {
+	    exit(EXIT_FAILURE);
+	}
     } else if (strcmp(argv[n], "fans") == 0) {
-	initFanControl();
-	if (strcmp(argv[n+1], "on") == 0) {
+	discoverSensors();
+	initFanControl(0);
+	if (n+1 >= argc) {
+	    usage(argc, argv);
+	} else if (strcmp(argv[n+1], "on") == 0) {
 	    finishFanControl(FANON);
 	} else if (strcmp(argv[n+1], "off") == 0) {
 	    finishFanControl(FANOFF);
@@ -866,10 +5819,6 @@ int main(int argc, char **argv)
 	usage(argc, argv);
     }
 
-    /* restore 	modem settings */
-    tcsetattr(fd, TCSANOW, &oldtio); 
-    close(fd);
-
     exit(EXIT_SUCCESS);
 } /* end main */
 
@@ -0,0 +1,93 @@
+/* Snapshot of the lcd server's readings in shared memory */
+/* The server rewrites it every second; readers map the file and */
+/* copy it with lcdshmRead(), which needs no locks or system calls. */
+/* Copyleft according to Gnu General Public License */
+
+#ifndef LCDSHM_H
+#define LCDSHM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define LCDSHMFILE "/dev/shm/lcd"
+#define LCDSHMMAGIC 0x4c434431          /* "LCD1" */
+#define LCDSHMDISKS 16
+#define LCDSHMRETRIES 1000              /* copies tried while the server writes */
+
+/* times are CLOCK_REALTIME milliseconds, 0 if never sampled; */
+/* a value that is not known is -1 or an empty string */
+typedef struct {
+    char name[32];
+    int32_t temp;                       /* degrees Celsius */
+    int32_t unused;
+    int64_t stamp;
+} LcdShmDisk;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t size;                      /* sizeof(LcdShm) of the writer */
+    uint32_t seq;                       /* odd while the server writes */
+    uint32_t unused;
+    int64_t stamp;                      /* when this snapshot was written */
+    int64_t sensorStamp;                /* when the sensors were read */
+    int32_t cpuTemp, sysTemp;           /* degrees Celsius */
+    int32_t cpuFan, sysFan;             /* rpm */
+    int32_t cpuFanOn, sysFanOn;         /* 1 on, 0 off, -1 not controlled */
+    int64_t uptime;                     /* seconds */
+    LcdShmDisk disks[LCDSHMDISKS];
+    char extAddr[48];                   /* as the internet sees us */
+    int64_t extStamp;
+    char lanIf[2][16];
+    char lanAddr[2][48];
+} LcdShm;
+
+/* map the snapshot read-only, NULL if there is no server */
+static inline const LcdShm *lcdshmOpen(const char *path)
+{
+    const LcdShm *shm;
+    int fd = open(path != NULL ? path : LCDSHMFILE, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+	return NULL;
+    }
+    shm = mmap(NULL, sizeof(LcdShm), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+	return NULL;
+    }
+    if (shm->magic != LCDSHMMAGIC || shm->size != sizeof(LcdShm)) {
+	munmap((void *) shm, sizeof(LcdShm));
+	return NULL;
+    }
+    return shm;
+}
+
+static inline void lcdshmClose(const LcdShm *shm)
+{
+    munmap((void *) shm, sizeof(LcdShm));
+}
+
+/* copy a consistent snapshot, returns 0 if the server kept writing */
+static inline int lcdshmRead(const LcdShm *shm, LcdShm *copy)
+{
+    uint32_t seq;
+    int tries;
+
+    for (tries = 0; tries < LCDSHMRETRIES; tries++) {
+	seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+	if (seq & 1) {
+	    continue;
+	}
+	memcpy(copy, shm, sizeof(*copy));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) == seq) {
+	    return 1;
+	}
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,537 @@
+#!/usr/bin/env python3
+# checks of lcd against the sim backend, run by make check
+#
+# usage: check.py [path of lcd]
+
+import http.server
+import os
+import re
+import select
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+LCD = os.path.abspath(sys.argv[1] if len(sys.argv) > 1 else "./lcd")
+ADDRESS = b"2001:db8::42"
+DOUBLEPRESS = 3.0       # seconds of the power off prompt
+
+
+class Endpoint(http.server.BaseHTTPRequestHandler):
+    """an address lookup that answers once the test lets it: /ip with
+    the address and an ETag, /html with a web page, /down with 500"""
+    release = threading.Event()
+    requests = []       # path and If-None-Match of each request
+    ETAG = '"a1"'
+
+    def do_GET(self):
+        self.release.wait(30)
+        etag = self.headers.get("If-None-Match")
+        self.requests.append((self.path, etag))
+        if self.path == "/down":
+            self.send_error(500)
+            return
+        if self.path == "/ip" and etag == self.ETAG:
+            self.send_response(304)
+            self.end_headers()
+            return
+        self.send_response(200)
+        if self.path == "/html":
+            self.send_header("Content-Type", "text/html")
+            self.end_headers()
+            self.wfile.write(b"<html><body>" + ADDRESS + b"</body></html>\n")
+            return
+        self.send_header("Content-Type", "text/plain")
+        self.send_header("ETag", self.ETAG)
+        self.end_headers()
+        self.wfile.write(ADDRESS + b"\n")
+
+    def log_message(self, *args):
+        pass
+
+
+# a time zone where it is about noon, so the display is never dark
+TZ = "CHK%+d" % (time.gmtime().tm_hour - 12)
+
+
+class Lcd:
+    """a server on the sim backend in a directory of its own"""
+
+    def __init__(self, *options, record=False, files={}):
+        self.dir = tempfile.mkdtemp(prefix="lcd-check.")
+        for name, content in files.items():
+            os.makedirs(os.path.dirname(self.dir + "/" + name), exist_ok=True)
+            with open(self.dir + "/" + name, "w") as f:
+                f.write(content)
+        if record:
+            options = ("-r", self.dir + ".trace") + options
+        self.proc = subprocess.Popen(
+            [LCD, "-b", "sim:" + self.dir]
+            + list(options) + ["server"], env=dict(os.environ, TZ=TZ))
+        panel = self.dir + "/panel"
+        for _ in range(50):
+            if os.path.exists(panel):
+                break
+            time.sleep(0.1)
+        self.panel = os.open(panel, os.O_RDWR | os.O_NOCTTY)
+
+    def read(self, seconds):
+        """what the server sends to the panel in so many seconds"""
+        end = time.time() + seconds
+        out = b""
+        while time.time() < end:
+            ready, _, _ = select.select([self.panel], [], [], 0.05)
+            if ready:
+                out += os.read(self.panel, 4096)
+        return out
+
+    def press(self, keys):
+        os.write(self.panel, keys.encode())
+
+    def command(self, *args):
+        return subprocess.run([LCD, "-b", "sim:" + self.dir] + list(args),
+                              capture_output=True, text=True, timeout=10)
+
+    def stop(self, remove=True):
+        self.proc.terminate()
+        self.read(0.5)
+        status = self.proc.wait(10)
+        os.close(self.panel)
+        if remove:
+            shutil.rmtree(self.dir, ignore_errors=True)
+        return status
+
+
+def checkPromptSurvivesRefresh():
+    """new data for the shown page leaves the power prompt alone"""
+    httpd = http.server.ThreadingHTTPServer(("127.0.0.1", 0), Endpoint)
+    threading.Thread(target=httpd.serve_forever, daemon=True).start()
+    Endpoint.release.clear()
+    lcd = Lcd("-e", "http://127.0.0.1:%d/ip" % httpd.server_port)
+    try:
+        lcd.read(0.5)
+        lcd.command("page", "extaddr")
+        assert b"waiting" in lcd.read(0.5), "no EXTADDR page"
+        lcd.press("A")
+        assert b"Power: Off" in lcd.read(0.5), "no power prompt"
+        # the answer comes in while the prompt is shown
+        Endpoint.release.set()
+        out = lcd.read(DOUBLEPRESS / 2)
+        assert ADDRESS not in out, "the refresh wiped the power prompt"
+        # and is shown once the prompt times out
+        assert ADDRESS in lcd.read(DOUBLEPRESS), "no address after the prompt"
+    finally:
+        Endpoint.release.set()
+        lcd.stop()
+        httpd.shutdown()
+
+
+def checkPromptSurvivesStream():
+    """messages written while the power prompt is up wait for its end"""
+    lcd = Lcd()
+    try:
+        lcd.read(0.5)
+        client = socket.socket(socket.AF_UNIX)
+        client.connect(lcd.dir + "/lcd.sock")
+        client.settimeout(5)
+        lcd.press("A")
+        assert b"Power: Off" in lcd.read(0.5), "no power prompt"
+        out = b""
+        for n in range(20):
+            client.send(b"write frame %d\tstreamed\n" % n)
+            assert client.recv(100) == b"ok\n", "frame %d not taken" % n
+            out += lcd.read(0.05)
+        client.close()
+        out += lcd.read(DOUBLEPRESS / 4)
+        assert b"frame" not in out, "the stream wiped the power prompt"
+        assert b"frame 19" in lcd.read(DOUBLEPRESS), "no message after the prompt"
+    finally:
+        lcd.stop()
+
+
+def checkSimContained():
+    """the sim backend keeps its files, jobs and power to its directory"""
+    lcd = Lcd()
+    try:
+        lcd.read(1.5)
+        for name in ("history", "shm"):
+            assert os.path.exists(lcd.dir + "/" + name), "no " + name
+        assert lcd.command("dump").returncode == 0, "no snapshot to dump"
+        lcd.command("page", "firewall")
+        lcd.read(0.5)
+        lcd.press("A")
+        assert b"done" in lcd.read(1), "the firewall job did not end"
+        jobs = open(lcd.dir + "/jobs").read()
+        assert jobs == "/usr/local/sbin/firewall.sh\n", "jobs: %r" % jobs
+        for second in "AS":
+            lcd.press("A")
+            lcd.read(0.5)
+            lcd.press(second)
+            lcd.read(0.5)
+        power = open(lcd.dir + "/power").read()
+        assert power == "halt\nreboot\n", "power: %r" % power
+    finally:
+        lcd.stop()
+
+
+def lookup(*paths, options=()):
+    """a server asking the stand-in at paths, and the stand-in"""
+    httpd = http.server.ThreadingHTTPServer(("127.0.0.1", 0), Endpoint)
+    threading.Thread(target=httpd.serve_forever, daemon=True).start()
+    Endpoint.release.set()
+    del Endpoint.requests[:]
+    endpoints = []
+    for path in paths:
+        endpoints += ["-e", "http://127.0.0.1:%d%s" % (httpd.server_port, path)]
+    return Lcd(*(endpoints + list(options))), httpd
+
+
+def checkAddressOnly():
+    """an answer that is more than an address is not taken"""
+    lcd, httpd = lookup("/html")
+    try:
+        lcd.read(0.5)
+        lcd.command("page", "extaddr")
+        out = lcd.read(1)
+        assert ADDRESS not in out, "address taken from a web page"
+        assert b"None" in out, "no failure shown"
+    finally:
+        lcd.stop()
+        httpd.shutdown()
+
+
+def checkFailover():
+    """when the first endpoint fails the second one is asked"""
+    lcd, httpd = lookup("/html", "/ip")
+    try:
+        lcd.read(0.5)
+        lcd.command("page", "extaddr")
+        assert ADDRESS in lcd.read(1), "no address from the second endpoint"
+        paths = [path for path, _ in Endpoint.requests]
+        assert paths == ["/html", "/ip"], "asked %s" % paths
+    finally:
+        lcd.stop()
+        httpd.shutdown()
+
+
+def extAddress(lcd):
+    """address and confirmation stamp from the server's snapshot"""
+    for line in lcd.command("dump").stdout.splitlines():
+        if line.startswith("extaddr "):
+            return line.split()[1:]
+    return None
+
+
+def checkNotModified():
+    """a renewed address is asked for with the ETag, 304 confirms it"""
+    lcd, httpd = lookup("/ip", options=("-A", "1"))
+    try:
+        lcd.read(0.5)
+        lcd.command("page", "extaddr")
+        assert ADDRESS in lcd.read(1.5), "no address"
+        first = extAddress(lcd)
+        lcd.command("page", "extaddr")
+        lcd.read(1.5)
+        second = extAddress(lcd)
+        assert second[0] == ADDRESS.decode(), "304 lost the address"
+        assert int(second[1]) > int(first[1]), "304 did not confirm it"
+        assert Endpoint.requests == [("/ip", None), ("/ip", Endpoint.ETAG)], \
+            "asked %s" % Endpoint.requests
+    finally:
+        lcd.stop()
+        httpd.shutdown()
+
+
+def checkBackoff():
+    """after a failed round the endpoints are left alone for a while"""
+    lcd, httpd = lookup("/down")
+    try:
+        lcd.read(0.5)
+        lcd.command("page", "extaddr")
+        assert b"None" in lcd.read(1), "no failure shown"
+        for _ in range(3):
+            lcd.command("page", "extaddr")
+            lcd.read(0.3)
+        assert len(Endpoint.requests) == 1, \
+            "asked %d times in a row" % len(Endpoint.requests)
+    finally:
+        lcd.stop()
+        httpd.shutdown()
+
+
+DATE = re.compile(rb"\d\d-[A-Z][a-z][a-z]-\d{4}")
+
+
+def lastFrame(out):
+    """the frame the panel shows after out"""
+    return out.rsplit(b"\x1bX", 1)[-1]
+
+
+def showPage(lcd, name):
+    """show a page by name, its frame"""
+    lcd.command("page", name)
+    return lastFrame(lcd.read(0.5))
+
+
+def checkButtonBurst():
+    """two presses read at once are two presses"""
+    lcd = Lcd()
+    try:
+        lcd.read(0.5)
+        trend = showPage(lcd, "temptrend")
+        showPage(lcd, "datetime")
+        lcd.press("SS")
+        out = lcd.read(0.5)
+        assert b"Temperature" in out, "the first press got lost"
+        assert lastFrame(out) == trend, "the second press got lost"
+    finally:
+        lcd.stop()
+
+
+def checkButtonDebounce():
+    """a second press within the bounce time is the same press"""
+    lcd = Lcd()
+    try:
+        lcd.read(0.5)
+        showPage(lcd, "datetime")
+        lcd.press("S")
+        time.sleep(0.01)
+        lcd.press("S")
+        assert b"Temperature" in lastFrame(lcd.read(0.5)), "bounce seen as a press"
+    finally:
+        lcd.stop()
+
+
+def checkButtonLongPress():
+    """a held display button goes back to the date and time"""
+    lcd = Lcd()
+    try:
+        lcd.read(0.5)
+        showPage(lcd, "fans")
+        # the panel repeats a held button every 50 ms or so
+        out = b""
+        for _ in range(26):
+            lcd.press("S")
+            out += lcd.read(0.05)
+        out += lcd.read(0.5)
+        frames = out.split(b"\x1bX")[1:]
+        assert frames and not DATE.search(frames[0]), "no next page first"
+        assert DATE.search(frames[-1]), "no date after a long press"
+    finally:
+        lcd.stop()
+
+
+def checkPowerDeadline():
+    """the second power press counts only within the prompt"""
+    lcd = Lcd()
+    try:
+        lcd.read(0.5)
+        lcd.press("A")
+        assert b"Power: Off" in lcd.read(0.5), "no power prompt"
+        lcd.read(DOUBLEPRESS)
+        lcd.press("A")
+        assert b"Power: Off" in lcd.read(0.5), "late press not a new prompt"
+        assert not os.path.exists(lcd.dir + "/power"), "late press powered off"
+    finally:
+        lcd.stop()
+
+
+def checkControlSocket():
+    """messages cannot smuggle in commands, and one server is enough"""
+    lcd = Lcd()
+    try:
+        lcd.read(0.5)
+        result = lcd.command("write", "a\nsubscribe", "b")
+        assert result.returncode != 0, "newline in a message taken"
+        client = socket.socket(socket.AF_UNIX)
+        client.connect(lcd.dir + "/lcd.sock")
+        client.settimeout(5)
+        for line, answer in [(b"write a\tb\tc\n", b"error control character\n"),
+                             (b"write a\x1bX\tb\n", b"error control character\n"),
+                             (b"write a\tb\n", b"ok\n")]:
+            client.send(line)
+            assert client.recv(100) == answer, "%r not answered %r" % (line, answer)
+        client.close()
+        result = subprocess.run([LCD, "-b", "sim:" + lcd.dir, "server"],
+                                capture_output=True, text=True, timeout=10)
+        assert result.returncode != 0, "a second server started"
+        result = lcd.command("bench", "1")
+        assert result.returncode != 0, "bench ran beside the server"
+        assert os.path.exists(lcd.dir + "/panel"), "bench took the panel"
+    finally:
+        lcd.stop()
+
+
+def checkPwmHandedBack():
+    """the server takes the pwm channels over and gives them back"""
+    lcd = Lcd()
+    enable = lcd.dir + "/hwmon/hwmon0/pwm1_enable"
+    try:
+        lcd.read(1)
+        assert open(enable).read().strip() == "1", "pwm1 not taken over"
+    finally:
+        lcd.stop(remove=False)
+    try:
+        assert open(enable).read().strip() == "2", "pwm1 not given back"
+        lcd.command("fans", "on")
+        assert open(enable).read().strip() == "2", "lcd fans took pwm1 over"
+    finally:
+        shutil.rmtree(lcd.dir, ignore_errors=True)
+
+
+def checkThresholdFallback():
+    """a chip without temp*_max gets the compiled-in switch points"""
+    duties = []
+    for limit in ("60000\n", "0\n"):
+        lcd = Lcd(files={"hwmon/hwmon0/temp2_max": limit})
+        try:
+            lcd.read(2)
+            duties.append(open(lcd.dir + "/hwmon/hwmon0/pwm1").read().strip())
+        finally:
+            lcd.stop()
+    assert duties[0] != "255", "pwm1 at full speed with a limit"
+    assert duties[1] == duties[0], "pwm1 at %s without a limit" % duties[1]
+
+
+def checkSensorLost():
+    """a temperature that can't be read runs the fan at full speed"""
+    # a directory opens but can't be read, like a driver gone away
+    lcd = Lcd(files={"hwmon/hwmon0/temp2_input/keep": ""})
+    try:
+        lcd.read(2)
+        duty = open(lcd.dir + "/hwmon/hwmon0/pwm1").read().strip()
+        assert duty == "255", "pwm1 at %s without a temperature" % duty
+    finally:
+        lcd.stop()
+
+
+def checkSensorMoved():
+    """a driver that comes back as another hwmonN is found again"""
+    lcd = Lcd(files={"hwmon/hwmon0/name": "gone\n"})
+    moved = lcd.dir + "/hwmon/hwmon1"
+    try:
+        lcd.read(0.5)
+        assert lcd.command("sensor", "cputemp").stdout == "0\n", "no chip, a reading"
+        shutil.copytree(lcd.dir + "/hwmon/hwmon0", moved)
+        with open(moved + "/name", "w") as f:
+            f.write("via686a\n")
+        for _ in range(30):
+            if lcd.command("sensor", "cputemp").stdout == "45\n":
+                break
+            lcd.read(0.5)
+        else:
+            assert False, "the moved sensor was not found again"
+    finally:
+        lcd.stop()
+
+
+SAMPLE = re.compile(r'([a-zA-Z_:][a-zA-Z0-9_:]*)'
+                    r'(\{[a-zA-Z_]\w*="[^"\\\n]*"(,[a-zA-Z_]\w*="[^"\\\n]*")*\})?'
+                    r' (\S+)')
+
+
+def parseMetrics(text):
+    """the families of the Prometheus text format, or an AssertionError"""
+    types = {}
+    family = None
+    for line in text.splitlines():
+        if line.startswith("#"):
+            words = line.split(None, 3)
+            assert len(words) == 4 and words[1] in ("HELP", "TYPE"), \
+                "bad comment: " + line
+            if words[1] == "TYPE":
+                assert words[2] not in types, "TYPE twice: " + line
+                assert words[3] in ("counter", "gauge", "summary",
+                                    "histogram", "untyped"), line
+                types[words[2]] = words[3]
+                family = words[2]
+            continue
+        match = SAMPLE.fullmatch(line)
+        assert match, "bad sample: " + line
+        float(match.group(4))
+        name = match.group(1)
+        if types.get(family) in ("summary", "histogram"):
+            assert name in (family, family + "_sum", family + "_count",
+                            family + "_bucket"), "not in its family: " + line
+        else:
+            assert name == family, "not in its family: " + line
+        if types[family] == "counter":
+            assert name.endswith("_total"), "counter without _total: " + line
+    return types
+
+
+def checkMetrics():
+    """the metrics file is in the Prometheus text format"""
+    metrics = tempfile.gettempdir() + "/lcd-check.prom"
+    lcd = Lcd("-M", "1", "-m", metrics)
+    try:
+        lcd.read(2.5)
+        text = open(metrics).read()
+    finally:
+        lcd.stop()
+    types = parseMetrics(text)
+    assert types.get("lcd_forks_total") == "counter", "no lcd_forks_total"
+    if shutil.which("promtool"):
+        result = subprocess.run(["promtool", "check", "metrics"], input=text,
+                                capture_output=True, text=True)
+        assert result.returncode == 0, result.stdout + result.stderr
+    os.unlink(metrics)
+
+
+def roundTrip(*options):
+    """record a walk through all pages and replay it"""
+    lcd = Lcd(*options, record=True)
+    trace = lcd.dir + ".trace"
+    try:
+        lcd.read(0.5)
+        for _ in range(14):
+            lcd.press("S")
+            lcd.read(0.4)
+    finally:
+        lcd.stop()
+    result = subprocess.run([LCD, "replay", trace], capture_output=True,
+                            text=True, timeout=60, env=dict(os.environ, TZ=TZ))
+    os.unlink(trace)
+    assert result.returncode == 0, result.stdout + result.stderr
+
+
+def checkReplayPlain():
+    """a session recorded without options replays as it ran"""
+    roundTrip()
+
+
+def checkReplayOptions():
+    """the options of the recording apply to the replay"""
+    httpd = http.server.ThreadingHTTPServer(("127.0.0.1", 0), Endpoint)
+    threading.Thread(target=httpd.serve_forever, daemon=True).start()
+    Endpoint.release.set()
+    try:
+        roundTrip("-f", "-a", "7", "-p", "0", "-i", "lo",
+                  "-e", "http://localhost:%d/ip" % httpd.server_port)
+    finally:
+        httpd.shutdown()
+
+
+def main():
+    failed = 0
+    for check in [checkPromptSurvivesRefresh, checkPromptSurvivesStream,
+                  checkReplayPlain, checkReplayOptions, checkPwmHandedBack,
+                  checkThresholdFallback, checkSensorLost, checkSensorMoved,
+                  checkMetrics, checkAddressOnly, checkFailover,
+                  checkNotModified, checkBackoff, checkButtonBurst,
+                  checkButtonDebounce, checkButtonLongPress,
+                  checkPowerDeadline, checkSimContained, checkControlSocket]:
+        try:
+            check()
+            print("ok", check.__name__)
+        except AssertionError as e:
+            print("FAIL", check.__name__ + ":", e)
+            failed += 1
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == "__main__":
+    main()